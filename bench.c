@@ -0,0 +1,280 @@
+/* Expose clock_gettime under -std=c99 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include "flisp.h"
+
+/* Benchmark of the array builtins against plain scalar C loops on the */
+/* same data and, where it is small enough, against the same arithmetic */
+/* written as nested Q-expressions of "+" and "*". Run with "make bench". */
+
+/* Number of runs of each measurement, of which the fastest is reported */
+#define BENCH_RUNS 5
+
+/**************************************************************************/
+/******************** TEXT BUFFER *****************************************/
+/**************************************************************************/
+
+/* Growing buffer the inputs are written into */
+typedef struct {
+  char* s;
+  size_t len;
+  size_t cap;
+} bbuf;
+
+static void bbuf_add(bbuf* b, const char* fmt, ...) {
+  for (;;) {
+    va_list va;
+    va_start(va, fmt);
+    int n = vsnprintf(b->s + b->len, b->cap - b->len, fmt, va);
+    va_end(va);
+    if (b->len + n < b->cap) {
+      b->len += n;
+      return;
+    }
+    b->cap = (b->cap + n + 1) * 2;
+    b->s = realloc(b->s, b->cap);
+  }
+}
+
+/**************************************************************************/
+/******************** DATA ************************************************/
+/**************************************************************************/
+
+/* Small deterministic integers, so that sums fit in a long and floats */
+/* built from them are exact */
+static unsigned long bench_seed = 12345;
+
+static long bench_rand(void) {
+  bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+  return (long) (bench_seed >> 33) % 19 - 9;
+}
+
+/* Matrix of rows x cols random integers, row-major */
+static long* bench_matrix(int rows, int cols) {
+  long* m = malloc(sizeof(long) * rows * cols);
+  for (int i = 0; i < rows * cols; i++) { m[i] = bench_rand(); }
+  return m;
+}
+
+/* Write "m" as the argument of "array", with a ".5" on every element */
+/* when "flt" is set */
+static void bench_array_text(bbuf* b, long* m, int rows, int cols, int flt) {
+  bbuf_add(b, "(array {");
+  for (int i = 0; i < rows; i++) {
+    bbuf_add(b, "{");
+    for (int j = 0; j < cols; j++) {
+      bbuf_add(b, flt ? "%li.5 " : "%li ", m[i * cols + j]);
+    }
+    bbuf_add(b, "} ");
+  }
+  bbuf_add(b, "})");
+}
+
+/* Define "name" in "c" as the array "m" */
+static void bench_def(lctx* c, const char* name, long* m, int rows, int cols, int flt) {
+  bbuf b = {NULL, 0, 0};
+  bbuf_add(&b, "def {%s} ", name);
+  bench_array_text(&b, m, rows, cols, flt);
+  lval* r = lctx_eval(c, "<bench>", b.s);
+  if (r) { lval_del(r); }
+  free(b.s);
+}
+
+/* Define "name" in "c" as the Q-expression that computes the product of */
+/* a (n x p) and b (p x m) one sum of products at a time. It is a list */
+/* of rows, each "{list (+ (* a b) ...) ...}", to be evaluated by "map". */
+static void bench_def_qexpr(lctx* c, const char* name,
+			    long* a, long* b, int n, int p, int m) {
+  bbuf t = {NULL, 0, 0};
+  bbuf_add(&t, "def {%s} {", name);
+  for (int i = 0; i < n; i++) {
+    bbuf_add(&t, "{list ");
+    for (int j = 0; j < m; j++) {
+      bbuf_add(&t, "(+");
+      for (int k = 0; k < p; k++) {
+	bbuf_add(&t, " (* %li %li)", a[i * p + k], b[k * m + j]);
+      }
+      bbuf_add(&t, ") ");
+    }
+    bbuf_add(&t, "} ");
+  }
+  bbuf_add(&t, "}");
+  lval* r = lctx_eval(c, "<bench>", t.s);
+  if (r) { lval_del(r); }
+  free(t.s);
+}
+
+/**************************************************************************/
+/******************** SCALAR LOOPS ****************************************/
+/**************************************************************************/
+
+/* The kernels written the obvious way, for comparison */
+static long scalar_dot(const long* x, const long* y, int n) {
+  long sum = 0;
+  for (int i = 0; i < n; i++) { sum += x[i] * y[i]; }
+  return sum;
+}
+
+static void scalar_matmul(const long* a, const long* b, long* c,
+			  int n, int p, int m) {
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < m; j++) {
+      long sum = 0;
+      for (int k = 0; k < p; k++) { sum += a[i * p + k] * b[k * m + j]; }
+      c[i * m + j] = sum;
+    }
+  }
+}
+
+static void scalar_transpose(const long* src, long* dst, int rows, int cols) {
+  for (int i = 0; i < rows; i++) {
+    for (int j = 0; j < cols; j++) { dst[j * rows + i] = src[i * cols + j]; }
+  }
+}
+
+/**************************************************************************/
+/******************** TIMING **********************************************/
+/**************************************************************************/
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Fastest of BENCH_RUNS evaluations of "input" in "c", in milliseconds */
+static double bench_eval(lctx* c, const char* input) {
+  double best = 0;
+  for (int r = 0; r < BENCH_RUNS; r++) {
+    double t = bench_now();
+    lval* v = lctx_eval(c, "<bench>", input);
+    t = bench_now() - t;
+    if (v && lval_type(v) == LVAL_ERR) {
+      fprintf(stderr, "%s: %s\n", input, lval_get_err(v));
+      exit(1);
+    }
+    if (v) { lval_del(v); }
+    if (r == 0 || t < best) { best = t; }
+  }
+  return best;
+}
+
+/* The same for the scalar loops, run through a callback */
+typedef struct {
+  long* a;
+  long* b;
+  long* c;
+  int n, p, m;
+  long sum;
+} bench_args;
+
+static double bench_call(void (*f)(bench_args*), bench_args* x) {
+  double best = 0;
+  for (int r = 0; r < BENCH_RUNS; r++) {
+    double t = bench_now();
+    f(x);
+    t = bench_now() - t;
+    if (r == 0 || t < best) { best = t; }
+  }
+  return best;
+}
+
+static void run_dot(bench_args* x) { x->sum = scalar_dot(x->a, x->b, x->n); }
+static void run_matmul(bench_args* x) { scalar_matmul(x->a, x->b, x->c, x->n, x->p, x->m); }
+static void run_transpose(bench_args* x) { scalar_transpose(x->a, x->c, x->n, x->m); }
+
+static void bench_row(const char* name, const char* size,
+		      double scalar, double arr, double farr, double qexpr) {
+  printf("%-10s %-10s %10.3f %10.3f %10.3f", name, size, scalar, arr, farr);
+  if (qexpr >= 0) { printf(" %10.3f", qexpr); } else { printf(" %10s", "-"); }
+  printf("\n");
+}
+
+/**************************************************************************/
+/******************** MAIN ************************************************/
+/**************************************************************************/
+
+int main(int argc, char** argv) {
+  /* Sizes: a vector for dot, a small product that the Q-expression */
+  /* version can still manage, a large product, and a transpose */
+  int vn = 1 << 20, sn = 48, ln = 256, tn = 1024;
+
+  long* vx = bench_matrix(1, vn);
+  long* vy = bench_matrix(1, vn);
+  long* sa = bench_matrix(sn, sn);
+  long* sb = bench_matrix(sn, sn);
+  long* la = bench_matrix(ln, ln);
+  long* lb = bench_matrix(ln, ln);
+  long* ta = bench_matrix(tn, tn);
+  long* out = malloc(sizeof(long) * tn * tn);
+
+  /* Inputs are frozen, so that looking them up shares them rather than */
+  /* copying them into every measurement */
+  lctx* setup = lctx_new(NULL);
+  bench_def(setup, "vx", vx, 1, vn, 0);
+  bench_def(setup, "vy", vy, 1, vn, 0);
+  bench_def(setup, "fvx", vx, 1, vn, 1);
+  bench_def(setup, "fvy", vy, 1, vn, 1);
+  bench_def(setup, "sa", sa, sn, sn, 0);
+  bench_def(setup, "sb", sb, sn, sn, 0);
+  bench_def(setup, "fsa", sa, sn, sn, 1);
+  bench_def(setup, "fsb", sb, sn, sn, 1);
+  bench_def(setup, "la", la, ln, ln, 0);
+  bench_def(setup, "lb", lb, ln, ln, 0);
+  bench_def(setup, "fla", la, ln, ln, 1);
+  bench_def(setup, "flb", lb, ln, ln, 1);
+  bench_def(setup, "ta", ta, tn, tn, 0);
+  bench_def(setup, "fta", ta, tn, tn, 1);
+  bench_def_qexpr(setup, "sq", sa, sb, sn, sn, sn);
+  lctx* c = lctx_new(lctx_freeze(setup));
+
+  /* The builtins must agree with the scalar loops */
+  lval* d = lctx_eval(c, "<bench>", "dot vx vy");
+  long expect = scalar_dot(vx, vy, vn);
+  if (!d || lval_get_num(d) != expect) {
+    fprintf(stderr, "dot gave %li, Expected %li.\n", d ? lval_get_num(d) : 0, expect);
+    return 1;
+  }
+  lval_del(d);
+
+  char size[32];
+  printf("Fastest of %i runs in milliseconds\n\n", BENCH_RUNS);
+  printf("%-10s %-10s %10s %10s %10s %10s\n",
+	 "builtin", "size", "scalar C", "array", "float", "Q-expr");
+
+  bench_args x = {vx, vy, out, vn, 0, 0, 0};
+  snprintf(size, sizeof(size), "%i", vn);
+  bench_row("dot", size, bench_call(run_dot, &x),
+	    bench_eval(c, "dot vx vy"), bench_eval(c, "dot fvx fvy"), -1);
+
+  x = (bench_args) {sa, sb, out, sn, sn, sn, 0};
+  snprintf(size, sizeof(size), "%ix%i", sn, sn);
+  bench_row("matmul", size, bench_call(run_matmul, &x),
+	    bench_eval(c, "matmul sa sb"), bench_eval(c, "matmul fsa fsb"),
+	    bench_eval(c, "map eval sq"));
+
+  x = (bench_args) {la, lb, out, ln, ln, ln, 0};
+  snprintf(size, sizeof(size), "%ix%i", ln, ln);
+  bench_row("matmul", size, bench_call(run_matmul, &x),
+	    bench_eval(c, "matmul la lb"), bench_eval(c, "matmul fla flb"), -1);
+
+  x = (bench_args) {ta, NULL, out, tn, 0, tn, 0};
+  snprintf(size, sizeof(size), "%ix%i", tn, tn);
+  bench_row("transpose", size, bench_call(run_transpose, &x),
+	    bench_eval(c, "transpose ta"), bench_eval(c, "transpose fta"), -1);
+
+  lctx_del(c);
+  free(vx);
+  free(vy);
+  free(sa);
+  free(sb);
+  free(la);
+  free(lb);
+  free(ta);
+  free(out);
+  return 0;
+}
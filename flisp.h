@@ -0,0 +1,155 @@
+#ifndef flisp_h
+#define flisp_h
+
+/*
+** fLisp as a library. A program creates contexts, each an interpreter
+** with its own environment on top of the shared builtins, and evaluates
+** strings, buffers or files in them. Values come back as "lval"s to be
+** inspected with the functions below and freed with lval_del.
+**
+** Contexts may be used on different threads at once, but each by one
+** thread at a time. The builtins, the intern table and the worker pool
+** are shared by the whole process.
+*/
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* What the shared library exports, everything else being hidden */
+#if defined(__GNUC__) && !defined(_WIN32)
+#define FLISP_API __attribute__((visibility("default")))
+#else
+#define FLISP_API
+#endif
+
+/**************************************************************************/
+/******************** VALUES **********************************************/
+/**************************************************************************/
+
+struct lval;
+struct lenv;
+struct lctx;
+typedef struct lval lval;
+typedef struct lenv lenv;
+typedef struct lctx lctx;
+
+/* A builtin takes its arguments as an S-expression it owns, and returns */
+/* a new value, or an error from lval_err */
+typedef lval*(*lbuiltin)(lenv*, lval*);
+
+/* Create an enumeration of possible lval types */
+enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR,
+       LVAL_ARR, LVAL_HMAP, LVAL_BIG, LVAL_FLT, LVAL_SEQ, LVAL_RANGE,
+       LVAL_FUT, LVAL_CHAN, LVAL_CO };
+
+/* Constructors */
+FLISP_API lval* lval_num(long x);
+FLISP_API lval* lval_flt(double x);
+FLISP_API lval* lval_err(const char* fmt, ...);
+FLISP_API lval* lval_sym(const char* s);
+FLISP_API lval* lval_sexpr(void);
+FLISP_API lval* lval_qexpr(void);
+
+/* Append "x" to the list "v", taking ownership of it */
+FLISP_API lval* lval_add(lval* v, lval* x);
+/* Remove element "i" of "v" and return it */
+FLISP_API lval* lval_pop(lval* v, int i);
+/* Return element "i" of "v", deleting the rest */
+FLISP_API lval* lval_take(lval* v, int i);
+FLISP_API lval* lval_copy(lval* v);
+FLISP_API void lval_del(lval* v);
+
+/* Inspection. Numbers, symbols and errors read only values of their */
+/* type, and lists the elements of S- and Q-expressions. */
+FLISP_API int lval_type(lval* v);
+FLISP_API char* ltype_name(int t);
+FLISP_API long lval_get_num(lval* v);
+FLISP_API double lval_get_flt(lval* v);
+FLISP_API const char* lval_get_sym(lval* v);
+FLISP_API const char* lval_get_err(lval* v);
+FLISP_API int lval_count(lval* v);
+FLISP_API lval* lval_cell(lval* v, int i);
+
+/* Printing, and the printed form as a string to free */
+FLISP_API void lval_fprint(FILE* out, lval* v);
+FLISP_API void lval_fprintln(FILE* out, lval* v);
+FLISP_API void lval_print(lval* v);
+FLISP_API void lval_println(lval* v);
+FLISP_API char* lval_to_str(lval* v);
+
+/* Share frozen Q-expressions, and evaluate large arguments in parallel */
+extern FLISP_API int lval_hashcons;
+extern FLISP_API int lval_parallel;
+
+/**************************************************************************/
+/******************** CONTEXTS ********************************************/
+/**************************************************************************/
+
+/* Build what every context shares, which lctx_new does if needed */
+FLISP_API void lctx_init(void);
+
+/* A new context on top of "base", from lctx_freeze, or the builtins */
+FLISP_API lctx* lctx_new(lenv* base);
+FLISP_API void lctx_del(lctx* c);
+
+/* Freeze the definitions of "c" for other contexts to start from, for as */
+/* long as the program runs, and delete "c" */
+FLISP_API lenv* lctx_freeze(lctx* c);
+
+/* Environment of the context, for lctx_load */
+FLISP_API lenv* lctx_env(lctx* c);
+
+/* Send what print writes in the context to "out", or stdout if NULL */
+FLISP_API void lctx_set_output(lctx* c, FILE* out);
+
+/* Define "name" as a builtin in the context */
+FLISP_API void lctx_add_builtin(lctx* c, const char* name, lbuiltin f);
+
+/* Evaluate "input" as one line of the REPL. Returns NULL if it does not */
+/* parse, with the message in lctx_error. */
+FLISP_API lval* lctx_eval(lctx* c, const char* filename, const char* input);
+FLISP_API const char* lctx_error(lctx* c);
+
+/* Evaluate the top-level forms of a file or buffer in "e" one at a time, */
+/* stopping at the first error. Returns the last value or the error. */
+FLISP_API lval* lctx_load(lctx* c, lenv* e, const char* filename, FILE* f);
+FLISP_API lval* lctx_load_buffer(lctx* c, const char* filename,
+				 const char* buf, size_t len);
+
+/* The context evaluating on the current thread, or NULL */
+FLISP_API lctx* lctx_self(void);
+
+/**************************************************************************/
+/******************** PROGRAMS ********************************************/
+/**************************************************************************/
+
+/* Answer "id<TAB>expression" lines from "in" with "id<TAB>value" lines */
+FLISP_API int lbatch_run(lctx* c, int in, FILE* out);
+
+/* Settings of a server on a Unix socket */
+typedef struct {
+  /* Listening socket, set by the server */
+  int fd;
+  /* Frozen environment the sessions start from, NULL for the builtins */
+  lenv* base;
+  /* Limits on each request in milliseconds and megabytes, 0 for none */
+  long time_limit;
+  long memory_limit;
+  /* Environment the sessions start from, "base" without the builtins */
+  /* for files and sockets, set by the server */
+  lenv* env;
+} lserver;
+
+/* Serve at "path" with "workers" threads, or forked processes, */
+/* returning only on failure or, for processes, when told to stop */
+FLISP_API int lserve_run(lserver* srv, const char* path, int workers);
+FLISP_API int lserve_prefork(lserver* srv, const char* path, int workers);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
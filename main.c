@@ -0,0 +1,178 @@
+/* Expose system queries under -std=c99 */
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "flisp.h"
+
+/* Compiling on Windows */
+#ifdef _WIN32
+#define BUFFER_SIZE 2048
+
+/* Fake readline function, using a buffer of its own on every call */
+char* readline(char* prompt) {
+  char buffer[BUFFER_SIZE];
+  fputs(prompt, stdout);
+  if (!fgets(buffer, BUFFER_SIZE, stdin)) { return NULL; }
+  char* cpy = malloc(strlen(buffer)+1);
+  strcpy(cpy, buffer);
+  cpy[strlen(cpy)-1] = '\0';
+  return cpy;
+}
+
+/* Fake add_history function */
+void add_history(char* unused) {}
+
+#else
+/* Otherwise include the editline header */
+#include <editline/readline.h>
+#endif
+
+/**************************************************************************/
+/******************** MAIN ************************************************/
+/**************************************************************************/
+
+int main(int argc, char* argv[]) {
+
+  /* Server settings, defaulting to a worker per processor */
+  char* serve = NULL;
+  char* script = NULL;
+  char* prelude = NULL;
+  int batch = 0;
+  int prefork = 0;
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  long time_limit = 10000;
+  long memory_limit = 256;
+
+  /* Parse command line options */
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--hashcons") == 0) {
+      lval_hashcons = 1;
+    } else if (strcmp(argv[i], "--parallel") == 0) {
+      lval_parallel = 1;
+    } else if (strcmp(argv[i], "--batch") == 0) {
+      batch = 1;
+    } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+      serve = argv[++i];
+    } else if (strcmp(argv[i], "--prefork") == 0) {
+      prefork = 1;
+    } else if (strcmp(argv[i], "--prelude") == 0 && i + 1 < argc) {
+      prelude = argv[++i];
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      workers = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--time-limit") == 0 && i + 1 < argc) {
+      time_limit = atol(argv[++i]);
+    } else if (strcmp(argv[i], "--memory-limit") == 0 && i + 1 < argc) {
+      memory_limit = atol(argv[++i]);
+    } else if (argv[i][0] != '-' && !script) {
+      script = argv[i];
+    } else {
+      fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+      return 1;
+    }
+  }
+
+  /* Load the prelude once, into the frozen environment every context */
+  /* starts from */
+  static lenv* base = NULL;
+  if (prelude) {
+    FILE* f = fopen(prelude, "r");
+    if (!f) {
+      perror(prelude);
+      return 1;
+    }
+    lctx* p = lctx_new(NULL);
+    lval* x = lctx_load(p, lctx_env(p), prelude, f);
+    fclose(f);
+    int failed = (lval_type(x) == LVAL_ERR);
+    if (failed) { lval_fprintln(stderr, x); }
+    lval_del(x);
+    if (failed) {
+      lctx_del(p);
+      return 1;
+    }
+    base = lctx_freeze(p);
+  }
+
+  if (serve) {
+    if (workers < 1 || workers > 1024 || time_limit < 0
+	|| memory_limit < 0 || memory_limit > LONG_MAX / (1024 * 1024)) {
+      fputs("Invalid server settings\n", stderr);
+      return 1;
+    }
+    lserver srv;
+    srv.base = base;
+    srv.time_limit = time_limit;
+    srv.memory_limit = memory_limit;
+    return prefork
+      ? lserve_prefork(&srv, serve, workers)
+      : lserve_run(&srv, serve, workers);
+  }
+
+  /* Run a script, reporting its first error */
+  if (script) {
+    FILE* f = fopen(script, "r");
+    if (!f) {
+      perror(script);
+      return 1;
+    }
+    lctx* c = lctx_new(base);
+    lval* x = lctx_load(c, lctx_env(c), script, f);
+    int status = (lval_type(x) == LVAL_ERR);
+    if (status) {
+      fflush(stdout);
+      lval_fprintln(stderr, x);
+    }
+    lval_del(x);
+    lctx_del(c);
+    fclose(f);
+    return status;
+  }
+
+  /* What requests print goes to stderr, to keep the replies framed */
+  if (batch) {
+    lctx* c = lctx_new(base);
+    lctx_set_output(c, stderr);
+    int status = lbatch_run(c, STDIN_FILENO, stdout);
+    lctx_del(c);
+    return status;
+  }
+
+  puts("fLisp Version 0.0.0.0.6");
+  puts("Copyright ©frazeal 2017");
+  puts("Press <Ctrl> + <c> to Exit\n");
+
+  lctx* c = lctx_new(base);
+
+  /* read-evaluate-print loop */
+  while(1) {
+
+    /* Output our prompt and get input, stopping at end of input */
+    char* input = readline("fLisp> ");
+    if (!input) { break; }
+
+    /* Add input to history */
+    add_history(input);
+
+    /* Evaluate the input, or report why it does not parse */
+    lval* x = lctx_eval(c, "<stdin>", input);
+    if (x) {
+      lval_println(x);
+      lval_del(x);
+    } else {
+      fputs(lctx_error(c), stdout);
+    }
+
+    /* Free retrieved input */
+    free(input);
+    
+  }
+
+  lctx_del(c);
+  
+  return 0;
+
+}
@@ -122,13 +122,12 @@ void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt, ...)
   va_end(va);
 }
 
-static char char_unescape_buffer[3];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char char_unescape_buffer[4]) {
   
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
   char_unescape_buffer[2] = '\'';
+  char_unescape_buffer[3] = '\0';
   
   switch (c) {
     
@@ -154,6 +153,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int max = 1023;
   int pos = 0; 
   int i;
+  char char_unescape_buffer[4];
   
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -178,7 +178,8 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, "%s",
+    mpc_err_char_unescape(x->recieved, char_unescape_buffer));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
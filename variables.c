@@ -1,33 +1,35 @@
+/* Expose POSIX threads and system queries under -std=c99 */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include "mpc.h"
+#include "flisp.h"
 
-/* Compiling on Windows */
-#ifdef _WIN32
-#include <string.h>
-
-#define BUFFER_SIZE 2048
-static char buffer[BUFFER_SIZE];
-
-/* Fake readline function */
-char* readline(char* prompt) {
-  fputs(prompt, stdout);
-  fgets(buffer, BUFFER_SIZE, stdin);
-  char* cpy = malloc(strlen(buffer)+1);
-  strcpy(cpy, buffer);
-  cpy[strlen(cpy)-1] = '\0';
-  return cpy;
-}
-
-/* Fake add_history function */
-void add_history(char* unused) {}
-
-#else
-/* Otherwise include the editline header */
-#include <editline/readline.h>
+/* Threads block on futexes where the kernel has them */
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #endif
 
+
 /**************************************************************************/
 /******************** DECLARATIONS ****************************************/
 /**************************************************************************/
@@ -35,47 +37,186 @@ void add_history(char* unused) {}
 /* Define maximum size for the error string buffer */
 #define MAX_ERR_BUFFER_SIZE 512
 
-/* Forward declarations of values, environment and builtin function type */
-struct lval;
-struct lenv;
-typedef struct lval lval;
-typedef struct lenv lenv;
-
-typedef lval*(*lbuiltin)(lenv*, lval*);
+/* Forward declarations of the values' internal types */
+struct lmemo;
+struct lhmap;
+struct lseq;
+struct lfuture;
+struct lchan;
+struct lco;
+typedef struct lmemo lmemo;
+typedef struct lhmap lhmap;
+typedef struct lseq lseq;
+typedef struct lfuture lfuture;
+typedef struct lchan lchan;
+typedef struct lco lco;
 
 /**************************************************************************/
 /******************** LISP VALUE ******************************************/
 /**************************************************************************/
 
-/* Create an enumeration of possible lval types */
-enum { LVAL_ERR, LVAL_NUM, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+/* Arbitrary precision integer: sign (-1, 0 or 1) and magnitude of "len" */
+/* base 2^32 limbs, least significant first */
+typedef struct {
+  int sign;
+  int len;
+  uint32_t* d;
+} lbig;
 
-/* Declare new lval struct */
+/* Declare new lval struct. Each type uses only its own members of the */
+/* union, which must only be read once the type is known. */
 struct lval {
   int type;
-  long num;
-  /* Error and Symbol types have some string data */
-  char* err;
-  char* sym;
-  /* lbuiltin function type */
-  lbuiltin fun;
-  /* Count and Pointer to a list of "lval*" */
+  /* Number of elements of a list or a range */
   int count;
-  struct lval** cell;
+  /* Number of owners of a frozen, shared value. Zero for ordinary values, */
+  /* which are owned by exactly one holder and may be changed in place. */
+  int refs;
+  /* Structural hash, only meaningful while the value is frozen */
+  unsigned long hash;
+  union {
+    /* Numbers. Ranges hold "count" numbers from "num", each "step" from */
+    /* the last. */
+    struct {
+      long num;
+      long step;
+    };
+    /* Double precision floating point number */
+    double flt;
+    /* Integer too large for "num" */
+    lbig big;
+    /* Error and Symbol types have some string data */
+    char* err;
+    char* sym;
+    /* lbuiltin function type, with an optional call cache */
+    struct {
+      lbuiltin fun;
+      lmemo* memo;
+    };
+    /* Pointer to a list of "lval*" */
+    struct lval** cell;
+    /* Dense row-major numeric array of rows x cols elements, held in */
+    /* "data" or "fdata" as "elem" is LVAL_NUM or LVAL_FLT */
+    struct {
+      int rows;
+      int cols;
+      int elem;
+      union {
+	long* data;
+	double* fdata;
+      };
+    };
+    /* Hash map table, shared by reference */
+    lhmap* map;
+    /* Lazy sequence description, shared by reference */
+    lseq* seq;
+    /* Asynchronous evaluation, shared by reference */
+    lfuture* fut;
+    /* Queue of values passed between threads, shared by reference */
+    lchan* chan;
+    /* Cooperatively scheduled evaluation, shared by reference */
+    lco* co;
+  };
 };
 
+/* Reference counts of shared values may change on several threads at once */
+#define LREF_GET(r) __atomic_load_n(&(r), __ATOMIC_RELAXED)
+#define LREF_INC(r) __atomic_add_fetch(&(r), 1, __ATOMIC_RELAXED)
+#define LREF_DEC(r) __atomic_sub_fetch(&(r), 1, __ATOMIC_ACQ_REL)
+
+/* Frozen values that are never freed keep this count for good, so that */
+/* the threads sharing them never write to them */
+#define LREF_PERM INT_MAX
+
+/* Take another reference to the frozen value "v" */
+#define LVAL_REF(v) \
+  if (LREF_GET((v)->refs) != LREF_PERM) { LREF_INC((v)->refs); }
+
+/* Limits on the evaluations of one client of a server. Nodes are */
+/* counted as the thread evaluating under the budget allocates and */
+/* frees them, so "nodes" approximates the memory the client holds. */
+typedef struct {
+  long nodes;
+  /* Count when the current request started, and most nodes it may add, */
+  /* or 0 for no limit */
+  long base;
+  long max_nodes;
+  /* Monotonic time in milliseconds to stop at, or 0 for no limit */
+  long deadline;
+  int ticks;
+  /* Why evaluation was stopped, 0 while it may go on */
+  int spent;
+  /* Coroutines running under the budget that are yet to finish, and */
+  /* the one to queue once they have */
+  int cos;
+  lco* closer;
+} lbudget;
+
+enum { LBUDGET_TIME = 1, LBUDGET_MEMORY, LBUDGET_STACK, LBUDGET_CLOSED };
+
+/* Budget the current thread evaluates under, NULL for none */
+static __thread lbudget* lbudget_cur = NULL;
+
+static lval* lbudget_check(void);
+static long lclock_ms(void);
+
+/* Count "bytes" that a node holds besides itself, such as the limbs of */
+/* a big number, as that many nodes' worth, or give them back if negative */
+static void lbudget_charge(long bytes) {
+  if (lbudget_cur) { lbudget_cur->nodes += bytes / (long) sizeof(lval); }
+}
+
+/* Error if "bytes" more would not fit in the current budget, which then */
+/* stops, so that a large result can be refused before it is computed */
+static lval* lbudget_reserve(double bytes) {
+  lbudget* b = lbudget_cur;
+  if (!b || !b->max_nodes
+      || b->nodes - b->base + bytes / sizeof(lval) <= b->max_nodes) {
+    return NULL;
+  }
+  if (!b->spent) { b->spent = LBUDGET_MEMORY; }
+  return lbudget_check();
+}
+
+/* Whether the current budget has run out, its clock read right away. */
+/* Native loops that may run long check it now and then and stop early, */
+/* leaving a meaningless result that their caller replaces with the */
+/* budget's error. */
+static int lbudget_expired(void) {
+  lbudget* b = lbudget_cur;
+  if (!b) { return 0; }
+  if (!b->spent && b->deadline && lclock_ms() > b->deadline) {
+    b->spent = LBUDGET_TIME;
+  }
+  return b->spent != 0;
+}
+
+/* Allocate a new unshared lval of the given type */
+lval* lval_new(int type) {
+  lval* v = malloc(sizeof(lval));
+  if (lbudget_cur) { lbudget_cur->nodes++; }
+  v->type = type;
+  v->refs = 0;
+  return v;
+}
+
 /* Construct a pointer to a new number lval */
 lval* lval_num(long x) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  lval* v = lval_new(LVAL_NUM);
   v->num = x;
   return v;
 }
 
+/* Construct a pointer to a new floating point number lval */
+lval* lval_flt(double x) {
+  lval* v = lval_new(LVAL_FLT);
+  v->flt = x;
+  return v;
+}
+
 /* Construct a pointer to a new error type lval */
-lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+lval* lval_err(const char* fmt, ...) {
+  lval* v = lval_new(LVAL_ERR);
 
   /* Create a variable argument (va) list and initilize it */
   va_list va;
@@ -97,9 +238,8 @@ lval* lval_err(char* fmt, ...) {
 }
 
 /* Construct a pointer to a new symbol type lval */
-lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
+lval* lval_sym(const char* s) {
+  lval* v = lval_new(LVAL_SYM);
   v->sym = malloc(strlen(s) + 1);
   strcpy(v->sym, s);
   return v;
@@ -107,16 +247,15 @@ lval* lval_sym(char* s) {
 
 /* Construct a pointer to a new function type lval */
 lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_new(LVAL_FUN);
   v->fun = func;
+  v->memo = NULL;
   return v;
 }
 
 /* Construct a pointer to a new Sexpr type lval */
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval* v = lval_new(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -124,52 +263,272 @@ lval* lval_sexpr(void) {
 
 /* Construct a pointer to a new Qexpr type lval */
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval* v = lval_new(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
 }
 
-void lval_del(lval* v) {
+/* Construct a pointer to a new zero-filled array type lval */
+lval* lval_arr(int rows, int cols) {
+  lval* v = lval_new(LVAL_ARR);
+  v->rows = rows;
+  v->cols = cols;
+  v->elem = LVAL_NUM;
+  v->data = calloc((size_t) rows * cols, sizeof(long));
+  lbudget_charge((long) rows * cols * sizeof(long));
+  return v;
+}
+
+/* Construct a pointer to a new zero-filled array of floats */
+lval* lval_farr(int rows, int cols) {
+  lval* v = lval_new(LVAL_ARR);
+  v->rows = rows;
+  v->cols = cols;
+  v->elem = LVAL_FLT;
+  v->fdata = calloc((size_t) rows * cols, sizeof(double));
+  lbudget_charge((long) rows * cols * sizeof(double));
+  return v;
+}
+
+/* Size in bytes of one element and of all elements of an array, and */
+/* where they start */
+static size_t arr_size(lval* v) {
+  return (v->elem == LVAL_FLT) ? sizeof(double) : sizeof(long);
+}
+
+static long arr_bytes(lval* v) {
+  return (long) v->rows * v->cols * arr_size(v);
+}
+
+static void* arr_elems(lval* v) {
+  return (v->elem == LVAL_FLT) ? (void*) v->fdata : (void*) v->data;
+}
+
+lhmap* lhmap_new(void);
+
+/* Construct a pointer to a new empty hash map type lval */
+lval* lval_hmap(void) {
+  lval* v = lval_new(LVAL_HMAP);
+  v->map = lhmap_new();
+  return v;
+}
+
+/* Construct a pointer to a new lazy sequence lval, taking over "s" */
+lval* lval_seq(lseq* s) {
+  lval* v = lval_new(LVAL_SEQ);
+  v->seq = s;
+  return v;
+}
+
+/* Construct a pointer to a new future lval, taking over a reference to "f" */
+lval* lval_fut(lfuture* f) {
+  lval* v = lval_new(LVAL_FUT);
+  v->fut = f;
+  return v;
+}
+
+/* Construct a pointer to a new channel lval, taking over a reference to "c" */
+lval* lval_chan(lchan* c) {
+  lval* v = lval_new(LVAL_CHAN);
+  v->chan = c;
+  return v;
+}
+
+/* Construct a pointer to a new coroutine lval, taking over a reference */
+lval* lval_co(lco* c) {
+  lval* v = lval_new(LVAL_CO);
+  v->co = c;
+  return v;
+}
+
+/* Construct a pointer to a new range of "count" numbers from "start" */
+lval* lval_range(long start, long step, int count) {
+  lval* v = lval_new(LVAL_RANGE);
+  v->num = start;
+  v->step = step;
+  v->count = count;
+  return v;
+}
+
+/* Element "i" of a range. The element always lies between the ends of */
+/* the range, so the unsigned arithmetic wraps back to the right value. */
+long lrange_at(lval* r, long i) {
+  return (long) ((unsigned long) r->num + (unsigned long) i * (unsigned long) r->step);
+}
+
+/* Expand a range into a list of its numbers */
+lval* lrange_list(lval* r) {
+  lval* q = lval_qexpr();
+  q->cell = malloc(sizeof(lval*) * r->count);
+  for (int i = 0; i < r->count; i++) { q->cell[i] = lval_num(lrange_at(r, i)); }
+  q->count = r->count;
+  return q;
+}
+
+/* Lists are the only values that own other values */
+#define LVAL_IS_LIST(v) ((v)->type == LVAL_SEXPR || (v)->type == LVAL_QEXPR)
+
+/* Frozen lists share their cell array with every other owner */
+#define LVAL_OWNS_CELLS(v) (LVAL_IS_LIST(v) && LREF_GET((v)->refs) == 0)
+
+/* Append the elements of list "x" to a growable queue of nodes */
+static lval** lval_queue_cells(lval** q, int* n, int* cap, lval* x) {
+  if (x->count == 0) { return q; }
+  if (*n + x->count > *cap) {
+    while (*n + x->count > *cap) { *cap *= 2; }
+    q = realloc(q, sizeof(lval*) * *cap);
+  }
+  memcpy(&q[*n], x->cell, sizeof(lval*) * x->count);
+  *n += x->count;
+  return q;
+}
+
+/* Collect every node of the tree rooted at "v" in breadth-first order */
+/* into a newly allocated list, returning the number of nodes. The list */
+/* doubles as the work queue, so no recursion is needed at any depth. */
+/* Frozen values are listed but not descended into. */
+int lval_walk(lval* v, lval*** out) {
+  int cap = 16;
+  int n = 1;
+  lval** nodes = malloc(sizeof(lval*) * cap);
+  nodes[0] = v;
+
+  for (int i = 0; i < n; i++) {
+    if (LVAL_OWNS_CELLS(nodes[i])) {
+      nodes = lval_queue_cells(nodes, &n, &cap, nodes[i]);
+    }
+  }
+
+  *out = nodes;
+  return n;
+}
+
+lmemo* lmemo_share(lmemo* m);
+void lmemo_release(lmemo* m);
+lhmap* lhmap_share(lhmap* m);
+void lhmap_release(lhmap* m);
+lseq* lseq_share(lseq* s);
+void lseq_release(lseq* s);
+lfuture* lfuture_share(lfuture* f);
+void lfuture_release(lfuture* f);
+lchan* lchan_share(lchan* c);
+void lchan_release(lchan* c);
+lco* lco_share(lco* c);
+void lco_release(lco* c);
+
+/* Free the data owned by a single node, but not its children */
+void lval_free_node(lval* v) {
 
   switch (v->type) {
-    /* Do nothing special for number type */
-  case LVAL_NUM: break;
+    /* Do nothing special for number types */
+  case LVAL_NUM:
+  case LVAL_FLT:
+  case LVAL_RANGE: break;
 
     /* For Err or Sym free the string data */
   case LVAL_ERR: free(v->err); break;
   case LVAL_SYM: free(v->sym); break;
 
-    /* Do nothing special for function type */
-  case LVAL_FUN: break;
+    /* Functions may share a call cache */
+  case LVAL_FUN: if (v->memo) { lmemo_release(v->memo); } break;
 
-    /* If Sexpr or Qexpr then delete all elements inside */
+    /* If Sexpr or Qexpr free the memory allocated to contain the pointers */
   case LVAL_SEXPR:
   case LVAL_QEXPR:
-    for (int i = 0; i < v->count; i++) {
-      lval_del(v->cell[i]);
-    }
-    /* Also free the memory allocated to contain the pointers */
     free(v->cell);
     break;
+
+    /* Arrays own a single packed block of numbers */
+  case LVAL_ARR:
+    lbudget_charge(-arr_bytes(v));
+    free(arr_elems(v));
+    break;
+
+    /* Maps drop their reference to the shared table */
+  case LVAL_HMAP: lhmap_release(v->map); break;
+
+    /* Big numbers own their limbs */
+  case LVAL_BIG:
+    lbudget_charge(-(long) v->big.len * sizeof(uint32_t));
+    free(v->big.d);
+    break;
+
+    /* Sequences drop their reference to the shared description */
+  case LVAL_SEQ: lseq_release(v->seq); break;
+
+    /* Futures drop their reference to the pending result */
+  case LVAL_FUT: lfuture_release(v->fut); break;
+
+    /* Channels drop their reference to the shared queue */
+  case LVAL_CHAN: lchan_release(v->chan); break;
+
+    /* Coroutines drop their reference to the shared state */
+  case LVAL_CO: lco_release(v->co); break;
   }
 
   /* Free the memory allocated for the "lval" struct itself */
+  if (lbudget_cur) { lbudget_cur->nodes--; }
   free(v);
-  
 }
 
-lval* lval_copy(lval* v) {
+void lval_unintern(lval* v);
+
+void lval_del(lval* v) {
+
+  /* Unshared atoms need no work list */
+  if (!LVAL_IS_LIST(v) && LREF_GET(v->refs) == 0) {
+    lval_free_node(v);
+    return;
+  }
+
+  /* Gather every node that loses its last owner, then free them in one */
+  /* batch. Frozen nodes that still have other owners stop the descent. */
+  int cap = 16;
+  int n = 1;
+  lval** nodes = malloc(sizeof(lval*) * cap);
+  nodes[0] = v;
+
+  for (int i = 0; i < n; i++) {
+    lval* x = nodes[i];
+    if (LREF_GET(x->refs)) {
+      if (LREF_GET(x->refs) == LREF_PERM || LREF_DEC(x->refs) > 0) {
+	nodes[i] = NULL;
+	continue;
+      }
+      lval_unintern(x);
+    }
+    if (LVAL_IS_LIST(x)) {
+      nodes = lval_queue_cells(nodes, &n, &cap, x);
+    }
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (nodes[i]) { lval_free_node(nodes[i]); }
+  }
+  free(nodes);
+}
+
+/* Copy a single node. Lists get a cell array of the right size whose */
+/* entries are left for the caller to fill. */
+lval* lval_copy_node(lval* v) {
 
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+  lval* x = lval_new(v->type);
 
   switch (v->type) {
 
     /* Copy Functions and Numbers Directly */
     case LVAL_NUM: x->num = v->num; break;
-    case LVAL_FUN: x->fun = v->fun; break;
+    case LVAL_FLT: x->flt = v->flt; break;
+    case LVAL_RANGE:
+      x->num = v->num;
+      x->step = v->step;
+      x->count = v->count;
+      break;
+    case LVAL_FUN:
+      x->fun = v->fun;
+      x->memo = v->memo ? lmemo_share(v->memo) : NULL;
+      break;
 
     /* Copy Strings using malloc and strcpy */
     case LVAL_ERR:
@@ -180,20 +539,417 @@ lval* lval_copy(lval* v) {
       x->sym = malloc(strlen(v->sym) + 1);
       strcpy(x->sym, v->sym); break;
 
-    /* Copy lists by copying each sub-expression */
+    /* Allocate room for the sub-expressions */
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
       x->cell = malloc(sizeof(lval*) * x->count);
-      for (int i = 0; i < x->count; i++) {
-	x->cell[i] = lval_copy(v->cell[i]);
-      }
+      break;
+
+    /* Copy arrays with a single block copy of their elements */
+    case LVAL_ARR:
+      x->rows = v->rows;
+      x->cols = v->cols;
+      x->elem = v->elem;
+      if (v->elem == LVAL_FLT) { x->fdata = malloc(arr_bytes(v)); }
+      else { x->data = malloc(arr_bytes(v)); }
+      memcpy(arr_elems(x), arr_elems(v), arr_bytes(v));
+      lbudget_charge(arr_bytes(v));
+      break;
+
+    /* Maps, sequences, futures, channels and coroutines are copied by */
+    /* reference */
+    case LVAL_HMAP: x->map = lhmap_share(v->map); break;
+    case LVAL_SEQ: x->seq = lseq_share(v->seq); break;
+    case LVAL_FUT: x->fut = lfuture_share(v->fut); break;
+    case LVAL_CHAN: x->chan = lchan_share(v->chan); break;
+    case LVAL_CO: x->co = lco_share(v->co); break;
+
+    case LVAL_BIG:
+      x->big = v->big;
+      x->big.d = malloc(sizeof(uint32_t) * v->big.len);
+      memcpy(x->big.d, v->big.d, sizeof(uint32_t) * v->big.len);
+      lbudget_charge((long) v->big.len * sizeof(uint32_t));
       break;
     }
 
     return x;
 }
 
+lval* lval_copy(lval* v) {
+
+  /* Frozen values are copied by taking another reference */
+  if (LREF_GET(v->refs)) {
+    LVAL_REF(v);
+    return v;
+  }
+
+  /* Unshared atoms need no work list */
+  if (!LVAL_IS_LIST(v)) { return lval_copy_node(v); }
+
+  /* Pre-count the source tree, then copy it node by node in the same */
+  /* breadth-first order. The children of each list sit next to each */
+  /* other in that order, so they are linked up with a running cursor. */
+  lval** src;
+  int n = lval_walk(v, &src);
+  lval** dst = malloc(sizeof(lval*) * n);
+  for (int i = 0; i < n; i++) {
+    if (LREF_GET(src[i]->refs)) {
+      LVAL_REF(src[i]);
+      dst[i] = src[i];
+    } else {
+      dst[i] = lval_copy_node(src[i]);
+    }
+  }
+
+  int next = 1;
+  for (int i = 0; i < n; i++) {
+    if (!LVAL_OWNS_CELLS(dst[i])) { continue; }
+    for (int j = 0; j < dst[i]->count; j++) {
+      dst[i]->cell[j] = dst[next++];
+    }
+  }
+
+  lval* x = dst[0];
+  free(src);
+  free(dst);
+  return x;
+}
+
+int lval_claim(lval* v);
+
+/* Give the caller an unshared version of "v" that may be changed in place. */
+/* The children of a thawed list stay frozen until they are popped in turn. */
+lval* lval_thaw(lval* v) {
+  if (LREF_GET(v->refs) == 0) { return v; }
+
+  /* The only owner can simply take the value over */
+  if (LREF_GET(v->refs) == 1 && lval_claim(v)) { return v; }
+
+  lval* x = lval_copy_node(v);
+  if (LVAL_IS_LIST(v)) {
+    for (int i = 0; i < v->count; i++) {
+      x->cell[i] = v->cell[i];
+      LVAL_REF(x->cell[i]);
+    }
+  }
+  lval_del(v);
+  return x;
+}
+
+/**************************************************************************/
+/******************** HASH-CONSING ****************************************/
+/**************************************************************************/
+
+/* Values can be frozen into immutable, reference counted nodes that are */
+/* shared between owners. Every frozen node is kept unique in a weak */
+/* table keyed by its structural hash, so equal frozen trees are one and */
+/* the same tree. Readers intern Q-expression literals when enabled. */
+int lval_hashcons = 0;
+
+/* Mix a word into a running hash */
+static unsigned long lhash_mix(unsigned long h, unsigned long x) {
+  return h ^ (x + 0x9e3779b97f4a7c15UL + (h << 6) + (h >> 2));
+}
+
+/* FNV-1a hash of a string */
+static unsigned long lhash_str(const char* s) {
+  unsigned long h = 14695981039346656037UL;
+  while (*s) { h = (h ^ (unsigned char) *s++) * 1099511628211UL; }
+  return h;
+}
+
+/* Hash a single node, given the hashes of its children */
+unsigned long lval_hash_node(lval* v) {
+  unsigned long h = lhash_mix(0, v->type);
+  switch (v->type) {
+    case LVAL_NUM: h = lhash_mix(h, (unsigned long) v->num); break;
+    case LVAL_FLT: {
+      /* Hash the bits, which is what makes two floats the same value */
+      unsigned long bits;
+      memcpy(&bits, &v->flt, sizeof(bits));
+      h = lhash_mix(h, bits);
+      break;
+    }
+    case LVAL_ERR: h = lhash_mix(h, lhash_str(v->err)); break;
+    case LVAL_SYM: h = lhash_mix(h, lhash_str(v->sym)); break;
+    case LVAL_FUN:
+      h = lhash_mix(lhash_mix(h, (unsigned long) v->fun), (unsigned long) v->memo);
+      break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      for (int i = 0; i < v->count; i++) {
+	h = lhash_mix(h, v->cell[i]->hash);
+      }
+      break;
+    case LVAL_ARR:
+      h = lhash_mix(lhash_mix(lhash_mix(h, v->rows), v->cols), v->elem);
+      for (int i = 0; i < v->rows * v->cols; i++) {
+	/* Float elements are hashed by their bits, as single floats are */
+	unsigned long bits;
+	if (v->elem == LVAL_FLT) { memcpy(&bits, &v->fdata[i], sizeof(bits)); }
+	else { bits = (unsigned long) v->data[i]; }
+	h = lhash_mix(h, bits);
+      }
+      break;
+    case LVAL_HMAP: h = lhash_mix(h, (unsigned long) v->map); break;
+    case LVAL_SEQ: h = lhash_mix(h, (unsigned long) v->seq); break;
+    case LVAL_FUT: h = lhash_mix(h, (unsigned long) v->fut); break;
+    case LVAL_CHAN: h = lhash_mix(h, (unsigned long) v->chan); break;
+    case LVAL_CO: h = lhash_mix(h, (unsigned long) v->co); break;
+    case LVAL_RANGE:
+      h = lhash_mix(lhash_mix(lhash_mix(h, v->num), v->step), v->count);
+      break;
+    case LVAL_BIG:
+      h = lhash_mix(h, v->big.sign);
+      for (int i = 0; i < v->big.len; i++) { h = lhash_mix(h, v->big.d[i]); }
+      break;
+  }
+  return h;
+}
+
+/* Structural hash of any value. Frozen values answer from their cache, */
+/* the unshared part of a tree is hashed children first. */
+unsigned long lval_hash(lval* v) {
+  if (LREF_GET(v->refs)) { return v->hash; }
+
+  lval** nodes;
+  int n = lval_walk(v, &nodes);
+  for (int i = n-1; i >= 0; i--) {
+    if (LREF_GET(nodes[i]->refs) == 0) { nodes[i]->hash = lval_hash_node(nodes[i]); }
+  }
+  free(nodes);
+  return v->hash;
+}
+
+/* Compare two nodes whose children are already canonical */
+int lval_node_eq(lval* x, lval* y) {
+  if (x->type != y->type) { return 0; }
+  switch (x->type) {
+    case LVAL_NUM: return x->num == y->num;
+    /* The same bits, so that 0.0 and -0.0 stay apart and NaN is itself */
+    case LVAL_FLT: return memcmp(&x->flt, &y->flt, sizeof(double)) == 0;
+    case LVAL_ERR: return strcmp(x->err, y->err) == 0;
+    case LVAL_SYM: return strcmp(x->sym, y->sym) == 0;
+    case LVAL_FUN: return x->fun == y->fun && x->memo == y->memo;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR:
+      if (x->count != y->count) { return 0; }
+      for (int i = 0; i < x->count; i++) {
+	if (x->cell[i] != y->cell[i]) { return 0; }
+      }
+      return 1;
+    case LVAL_ARR:
+      return x->rows == y->rows && x->cols == y->cols && x->elem == y->elem
+	&& memcmp(arr_elems(x), arr_elems(y), arr_bytes(x)) == 0;
+    case LVAL_HMAP: return x->map == y->map;
+    case LVAL_SEQ: return x->seq == y->seq;
+    case LVAL_FUT: return x->fut == y->fut;
+    case LVAL_CHAN: return x->chan == y->chan;
+    case LVAL_CO: return x->co == y->co;
+    case LVAL_RANGE:
+      return x->num == y->num && x->step == y->step && x->count == y->count;
+    case LVAL_BIG:
+      return x->big.sign == y->big.sign && x->big.len == y->big.len
+	&& memcmp(x->big.d, y->big.d, sizeof(uint32_t) * x->big.len) == 0;
+  }
+  return 0;
+}
+
+/* Open addressing table of frozen values. Removed entries leave a */
+/* tombstone so that probe sequences stay intact. The lock covers the */
+/* table and every reference count taken through it. */
+static pthread_mutex_t lintern_lock = PTHREAD_MUTEX_INITIALIZER;
+static lval** lintern_slots = NULL;
+static int lintern_cap = 0;
+static int lintern_used = 0;
+static lval lintern_tomb;
+#define LINTERN_TOMB (&lintern_tomb)
+
+/* Take a reference to "v" unless its last owner is already freeing it */
+static int lref_acquire(lval* v) {
+  int r = __atomic_load_n(&v->refs, __ATOMIC_RELAXED);
+  if (r == LREF_PERM) { return 1; }
+  while (r > 0) {
+    if (__atomic_compare_exchange_n(&v->refs, &r, r + 1, 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Find a frozen value equal to "v" and take a reference to it */
+static lval* lintern_find(lval* v, unsigned long h) {
+  if (lintern_cap == 0) { return NULL; }
+  for (int i = h & (lintern_cap - 1); ; i = (i + 1) & (lintern_cap - 1)) {
+    lval* s = lintern_slots[i];
+    if (s == NULL) { return NULL; }
+    if (s != LINTERN_TOMB && s->hash == h && lval_node_eq(s, v)
+	&& lref_acquire(s)) {
+      return s;
+    }
+  }
+}
+
+static void lintern_insert(lval* v) {
+
+  /* Rebuild at twice the size, without tombstones, when half full */
+  if ((lintern_used + 1) * 2 > lintern_cap) {
+    lval** old = lintern_slots;
+    int old_cap = lintern_cap;
+    lintern_cap = old_cap ? old_cap * 2 : 256;
+    lintern_slots = calloc(lintern_cap, sizeof(lval*));
+    lintern_used = 0;
+    for (int i = 0; i < old_cap; i++) {
+      if (old[i] && old[i] != LINTERN_TOMB) { lintern_insert(old[i]); }
+    }
+    free(old);
+  }
+
+  int i = v->hash & (lintern_cap - 1);
+  while (lintern_slots[i] && lintern_slots[i] != LINTERN_TOMB) {
+    i = (i + 1) & (lintern_cap - 1);
+  }
+  if (lintern_slots[i] == NULL) { lintern_used++; }
+  lintern_slots[i] = v;
+}
+
+static void lintern_remove(lval* v) {
+  int i = v->hash & (lintern_cap - 1);
+  while (lintern_slots[i] != v) { i = (i + 1) & (lintern_cap - 1); }
+  lintern_slots[i] = LINTERN_TOMB;
+}
+
+/* Drop a frozen value that lost its last owner from the table */
+void lval_unintern(lval* v) {
+  pthread_mutex_lock(&lintern_lock);
+  lintern_remove(v);
+  pthread_mutex_unlock(&lintern_lock);
+}
+
+/* Unfreeze "v" for its only owner, unless the table has just handed out */
+/* another reference to it. Returns whether it was unfrozen. */
+int lval_claim(lval* v) {
+  pthread_mutex_lock(&lintern_lock);
+  int sole = (LREF_GET(v->refs) == 1);
+  if (sole) {
+    lintern_remove(v);
+    v->refs = 0;
+  }
+  pthread_mutex_unlock(&lintern_lock);
+  return sole;
+}
+
+/* Freeze the tree "v", taking ownership of it, and return the canonical */
+/* shared version of it. Nodes are canonicalised children first, so a */
+/* parent is compared against the table by the identity of its children. */
+lval* lval_intern(lval* v) {
+  if (LREF_GET(v->refs)) { return v; }
+
+  lval** nodes;
+  int n = lval_walk(v, &nodes);
+
+  /* Position of the first child of every list in walk order */
+  int* first = malloc(sizeof(int) * n);
+  int next = 1;
+  for (int i = 0; i < n; i++) {
+    if (LVAL_OWNS_CELLS(nodes[i])) {
+      first[i] = next;
+      next += nodes[i]->count;
+    }
+  }
+
+  for (int i = n-1; i >= 0; i--) {
+    lval* x = nodes[i];
+    if (LREF_GET(x->refs)) { continue; }
+
+    /* Point at the canonical children */
+    if (LVAL_IS_LIST(x)) {
+      for (int j = 0; j < x->count; j++) { x->cell[j] = nodes[first[i] + j]; }
+    }
+
+    /* Share an equal frozen node if there is one, otherwise freeze this */
+    unsigned long h = lval_hash_node(x);
+    pthread_mutex_lock(&lintern_lock);
+    lval* y = lintern_find(x, h);
+    if (!y) {
+      x->refs = 1;
+      x->hash = h;
+      lintern_insert(x);
+    }
+    pthread_mutex_unlock(&lintern_lock);
+    if (y) {
+      lval_del(x);
+      nodes[i] = y;
+    }
+  }
+
+  lval* x = nodes[0];
+  free(first);
+  free(nodes);
+  return x;
+}
+
+/* Freeze the tree "v" for good, taking ownership of it. Its owners will */
+/* neither count nor free any of its nodes from now on. */
+lval* lval_perm(lval* v) {
+  v = lval_intern(v);
+
+  int cap = 16;
+  int n = 1;
+  lval** stack = malloc(sizeof(lval*) * cap);
+  stack[0] = v;
+  pthread_mutex_lock(&lintern_lock);
+  while (n > 0) {
+    lval* x = stack[--n];
+    if (LREF_GET(x->refs) == LREF_PERM) { continue; }
+    __atomic_store_n(&x->refs, LREF_PERM, __ATOMIC_RELAXED);
+    if (LVAL_IS_LIST(x)) { stack = lval_queue_cells(stack, &n, &cap, x); }
+  }
+  pthread_mutex_unlock(&lintern_lock);
+  free(stack);
+  return v;
+}
+
+/* Structural equality. Frozen values are canonical, so two distinct */
+/* frozen values always differ; other pairs are compared element-wise */
+/* with an explicit stack. */
+int lval_eq(lval* x, lval* y) {
+  int cap = 16;
+  int n = 0;
+  lval** stack = malloc(sizeof(lval*) * cap * 2);
+  stack[n++] = x;
+  stack[n++] = y;
+
+  int eq = 1;
+  while (eq && n > 0) {
+    lval* b = stack[--n];
+    lval* a = stack[--n];
+
+    if (a == b) { continue; }
+    if (LREF_GET(a->refs) && LREF_GET(b->refs)) { eq = 0; break; }
+
+    if (!LVAL_IS_LIST(a) || !LVAL_IS_LIST(b)) {
+      eq = lval_node_eq(a, b);
+      continue;
+    }
+    if (a->type != b->type || a->count != b->count) { eq = 0; break; }
+
+    if (n + a->count * 2 > cap * 2) {
+      while (n + a->count * 2 > cap * 2) { cap *= 2; }
+      stack = realloc(stack, sizeof(lval*) * cap * 2);
+    }
+    for (int i = 0; i < a->count; i++) {
+      stack[n++] = a->cell[i];
+      stack[n++] = b->cell[i];
+    }
+  }
+
+  free(stack);
+  return eq;
+}
+
 lval* lval_add(lval* v, lval* x) {
   v->count++;
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
@@ -236,7 +992,9 @@ lval* lval_pop(lval* v, int i) {
 
   /* Reallocate the memory used */
   v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-  return x;
+
+  /* The caller owns the item now and may change it */
+  return lval_thaw(x);
 }
 
 lval* lval_take(lval* v, int i) {
@@ -245,73 +1003,1056 @@ lval* lval_take(lval* v, int i) {
   return x;
 }
 
-/**************************************************************************/
-/******************** PRINTING ********************************************/
-/**************************************************************************/
-
-void lval_print(lval* v);
+/* Accessors for programs using the library, which only see "lval" as an */
+/* incomplete type. Each gives 0 or NULL for values of other types. */
+int lval_type(lval* v) {
+  return v->type;
+}
 
-void lval_print_expr(lval* v, char open, char close) {
-  putchar(open);
-  for (int i = 0; i < v->count; i++) {
+long lval_get_num(lval* v) {
+  return (v->type == LVAL_NUM) ? v->num : 0;
+}
 
-    /* Print value contained within */
-    lval_print(v->cell[i]);
+double lval_get_flt(lval* v) {
+  if (v->type == LVAL_FLT) { return v->flt; }
+  return (v->type == LVAL_NUM) ? v->num : 0;
+}
 
-    /* Don't print trailing space if last element */
-    if (i != v->count-1) {
-      putchar(' ');
-    }
-  }
-  putchar(close);
+const char* lval_get_sym(lval* v) {
+  return (v->type == LVAL_SYM) ? v->sym : NULL;
 }
 
-/* Print an "lval" */
-void lval_print(lval* v) {
-  switch (v->type) {
-    case LVAL_NUM:   printf("%li", v->num); break;
-    case LVAL_ERR:   printf("Error: %s", v->err); break;
-    case LVAL_SYM:   printf("%s", v->sym); break;
-    case LVAL_FUN:   printf("<function>"); break;
-    case LVAL_SEXPR: lval_print_expr(v, '(', ')'); break;
-    case LVAL_QEXPR: lval_print_expr(v, '{', '}'); break;
-  }
+const char* lval_get_err(lval* v) {
+  return (v->type == LVAL_ERR) ? v->err : NULL;
 }
 
-/* Print an "lval" followed by a newline */
-void lval_println(lval* v) {
-  lval_print(v);
-  putchar('\n');
+int lval_count(lval* v) {
+  return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) ? v->count : 0;
 }
 
-char* ltype_name(int t) {
-  switch (t) {
-    case LVAL_ERR: return "Error";
-    case LVAL_NUM: return "Number";
-    case LVAL_SYM: return "Symbol";
-    case LVAL_FUN: return "Function";
-    case LVAL_SEXPR: return "S-Expression";
-    case LVAL_QEXPR: return "Q-Expression";
-    default: return "Unknown";
-  }
+lval* lval_cell(lval* v, int i) {
+  return (i >= 0 && i < lval_count(v)) ? v->cell[i] : NULL;
 }
 
 /**************************************************************************/
-/******************** LIST ENVIRONMENT ************************************/
+/******************** MEMOIZATION *****************************************/
 /**************************************************************************/
 
-/* Declare new lenv struct */
-struct lenv {
+/* Default number of calls remembered by a memoized function */
+#define MEMO_DEFAULT_CAPACITY 256
+
+/* One remembered call: the frozen argument list and its frozen result */
+typedef struct {
+  unsigned long hash;
+  lval* args;
+  lval* result;
+  /* Next entry in the same bucket */
+  int chain;
+  /* Neighbours in recency order, most recently used first */
+  int prev;
+  int next;
+} lmemo_entry;
+
+/* Call cache shared by every copy of a memoized function value */
+struct lmemo {
+  int refs;
+  /* Held while the table is read or changed, but not during calls */
+  pthread_mutex_t lock;
+  int capacity;
   int count;
-  char** syms;
-  lval** vals;
+  int nbuckets;
+  int* buckets;
+  lmemo_entry* entries;
+  /* Most and least recently used entries */
+  int head;
+  int tail;
+  long hits;
+  long misses;
 };
 
-lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
-  e->count = 0;
-  e->syms = NULL;
+lmemo* lmemo_new(int capacity) {
+  lmemo* m = malloc(sizeof(lmemo));
+  m->refs = 1;
+  pthread_mutex_init(&m->lock, NULL);
+  m->capacity = capacity;
+  m->count = 0;
+  m->nbuckets = 1;
+  while (m->nbuckets < capacity * 2) { m->nbuckets *= 2; }
+  m->buckets = malloc(sizeof(int) * m->nbuckets);
+  for (int i = 0; i < m->nbuckets; i++) { m->buckets[i] = -1; }
+  m->entries = malloc(sizeof(lmemo_entry) * capacity);
+  m->head = -1;
+  m->tail = -1;
+  m->hits = 0;
+  m->misses = 0;
+  return m;
+}
+
+/* Take another reference to a call cache */
+lmemo* lmemo_share(lmemo* m) {
+  LREF_INC(m->refs);
+  return m;
+}
+
+void lmemo_release(lmemo* m) {
+  if (LREF_DEC(m->refs) > 0) { return; }
+  pthread_mutex_destroy(&m->lock);
+  for (int i = 0; i < m->count; i++) {
+    lval_del(m->entries[i].args);
+    lval_del(m->entries[i].result);
+  }
+  free(m->buckets);
+  free(m->entries);
+  free(m);
+}
+
+/* Unlink entry "i" from the recency list */
+static void lmemo_unlink(lmemo* m, int i) {
+  lmemo_entry* x = &m->entries[i];
+  if (x->prev >= 0) { m->entries[x->prev].next = x->next; } else { m->head = x->next; }
+  if (x->next >= 0) { m->entries[x->next].prev = x->prev; } else { m->tail = x->prev; }
+}
+
+/* Make entry "i" the most recently used */
+static void lmemo_push_front(lmemo* m, int i) {
+  lmemo_entry* x = &m->entries[i];
+  x->prev = -1;
+  x->next = m->head;
+  if (m->head >= 0) { m->entries[m->head].prev = i; }
+  m->head = i;
+  if (m->tail < 0) { m->tail = i; }
+}
+
+/* Find the entry remembering argument list "a", or -1 */
+static int lmemo_find(lmemo* m, lval* a, unsigned long h) {
+  for (int i = m->buckets[h & (m->nbuckets - 1)]; i >= 0; i = m->entries[i].chain) {
+    if (m->entries[i].hash == h && lval_eq(m->entries[i].args, a)) { return i; }
+  }
+  return -1;
+}
+
+/* Pick a free entry, evicting the least recently used one when full */
+static int lmemo_slot(lmemo* m) {
+  if (m->count < m->capacity) { return m->count++; }
+
+  int i = m->tail;
+  lmemo_entry* x = &m->entries[i];
+  int* p = &m->buckets[x->hash & (m->nbuckets - 1)];
+  while (*p != i) { p = &m->entries[*p].chain; }
+  *p = x->chain;
+  lmemo_unlink(m, i);
+  lval_del(x->args);
+  lval_del(x->result);
+  return i;
+}
+
+/* Call the memoized function "f" with the argument list "a". Hits answer */
+/* from the cache without running the builtin; successful misses are */
+/* remembered. Errors are never cached. */
+lval* lmemo_call(lenv* e, lval* f, lval* a) {
+  lmemo* m = f->memo;
+  unsigned long h = lval_hash(a);
+
+  pthread_mutex_lock(&m->lock);
+  int i = lmemo_find(m, a, h);
+  if (i >= 0) {
+    m->hits++;
+    lmemo_unlink(m, i);
+    lmemo_push_front(m, i);
+    lval* x = lval_copy(m->entries[i].result);
+    pthread_mutex_unlock(&m->lock);
+    lval_del(a);
+    return x;
+  }
+  m->misses++;
+  pthread_mutex_unlock(&m->lock);
+
+  lval* args = lval_intern(lval_copy(a));
+  lval* result = f->fun(e, a);
+  if (result->type == LVAL_ERR) {
+    lval_del(args);
+    return result;
+  }
+  result = lval_intern(result);
+
+  /* Another thread may have remembered the same call in the meantime */
+  pthread_mutex_lock(&m->lock);
+  if (lmemo_find(m, args, h) >= 0) {
+    pthread_mutex_unlock(&m->lock);
+    lval_del(args);
+    return result;
+  }
+
+  i = lmemo_slot(m);
+  lmemo_entry* x = &m->entries[i];
+  x->hash = h;
+  x->args = args;
+  x->result = result;
+  x->chain = m->buckets[h & (m->nbuckets - 1)];
+  m->buckets[h & (m->nbuckets - 1)] = i;
+  lmemo_push_front(m, i);
+  result = lval_copy(x->result);
+  pthread_mutex_unlock(&m->lock);
+  return result;
+}
+
+/**************************************************************************/
+/******************** HASH MAPS *******************************************/
+/**************************************************************************/
+
+/* A hash map is a mutable table shared by reference: every copy of a map */
+/* value refers to the same table, so lookups and updates never copy it. */
+/* Keys are frozen numbers or symbols and values are frozen on the way in, */
+/* so reading a value back only takes a reference to it. */
+
+/* Slot of the table; empty slots have a NULL key */
+typedef struct {
+  unsigned long hash;
+  lval* key;
+  lval* val;
+} lhmap_slot;
+
+struct lhmap {
+  int refs;
+  /* Held by the builtins while they read or change the table */
+  pthread_mutex_t lock;
+  int count;
+  int cap;
+  lhmap_slot* slots;
+};
+
+lhmap* lhmap_new(void) {
+  lhmap* m = malloc(sizeof(lhmap));
+  m->refs = 1;
+  pthread_mutex_init(&m->lock, NULL);
+  m->count = 0;
+  m->cap = 8;
+  m->slots = calloc(m->cap, sizeof(lhmap_slot));
+  return m;
+}
+
+/* Take another reference to a table */
+lhmap* lhmap_share(lhmap* m) {
+  LREF_INC(m->refs);
+  return m;
+}
+
+void lhmap_release(lhmap* m) {
+  if (LREF_DEC(m->refs) > 0) { return; }
+  pthread_mutex_destroy(&m->lock);
+  for (int i = 0; i < m->cap; i++) {
+    if (m->slots[i].key) {
+      lval_del(m->slots[i].key);
+      lval_del(m->slots[i].val);
+    }
+  }
+  free(m->slots);
+  free(m);
+}
+
+/* Index of the slot holding key "k" with hash "h", or of the empty slot */
+/* where it would go. Linear probing keeps a probe in few cache lines. */
+static int lhmap_probe(lhmap* m, lval* k, unsigned long h) {
+  int mask = m->cap - 1;
+  int i = h & mask;
+  while (m->slots[i].key) {
+    lhmap_slot* s = &m->slots[i];
+    if (s->hash == h && (s->key == k || lval_node_eq(s->key, k))) { return i; }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+/* Find the value stored under "k", or NULL */
+lval* lhmap_get(lhmap* m, lval* k) {
+  int i = lhmap_probe(m, k, lval_hash(k));
+  return m->slots[i].key ? m->slots[i].val : NULL;
+}
+
+/* Store "v" under "k", taking ownership of both */
+void lhmap_put(lhmap* m, lval* k, lval* v) {
+
+  /* Double the table when three quarters full */
+  if ((m->count + 1) * 4 > m->cap * 3) {
+    lhmap_slot* old = m->slots;
+    int old_cap = m->cap;
+    m->cap *= 2;
+    m->slots = calloc(m->cap, sizeof(lhmap_slot));
+    for (int i = 0; i < old_cap; i++) {
+      if (old[i].key) {
+	int j = old[i].hash & (m->cap - 1);
+	while (m->slots[j].key) { j = (j + 1) & (m->cap - 1); }
+	m->slots[j] = old[i];
+      }
+    }
+    free(old);
+  }
+
+  k = lval_intern(k);
+  v = lval_intern(v);
+  int i = lhmap_probe(m, k, k->hash);
+  lhmap_slot* s = &m->slots[i];
+  if (s->key) {
+    lval_del(k);
+    lval_del(s->val);
+  } else {
+    s->hash = k->hash;
+    s->key = k;
+    m->count++;
+  }
+  s->val = v;
+}
+
+/* Remove key "k", returning whether it was present */
+int lhmap_del(lhmap* m, lval* k) {
+  int mask = m->cap - 1;
+  int i = lhmap_probe(m, k, lval_hash(k));
+  if (!m->slots[i].key) { return 0; }
+
+  lval_del(m->slots[i].key);
+  lval_del(m->slots[i].val);
+  m->count--;
+
+  /* Shift later members of the probe run back so no tombstone is needed */
+  for (int j = (i + 1) & mask; m->slots[j].key; j = (j + 1) & mask) {
+    int home = m->slots[j].hash & mask;
+    int between = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+    if (!between) {
+      m->slots[i] = m->slots[j];
+      i = j;
+    }
+  }
+  m->slots[i].key = NULL;
+  return 1;
+}
+
+/**************************************************************************/
+/******************** BIG NUMBERS *****************************************/
+/**************************************************************************/
+
+/* Integers that do not fit in a long are kept as a sign and a magnitude */
+/* of base 2^32 limbs. Results are always normalised, so a value that fits */
+/* in a long is a plain Number and big numbers never have leading zeros. */
+
+/* Operand size, in limbs, from which multiplication switches to Karatsuba */
+#define KARATSUBA_THRESHOLD 32
+
+/* Operand size, in limbs, from which long operations watch the budget */
+#define LBIG_CHECK_LIMBS 1024
+
+/* Largest power of ten that fits in a limb, used for decimal conversion */
+#define LBIG_DEC_BASE 1000000000u
+#define LBIG_DEC_DIGITS 9
+
+/* Allocate a zero big number with room for "len" limbs */
+static lbig lbig_alloc(int len) {
+  lbig a;
+  a.sign = 0;
+  a.len = len;
+  a.d = calloc(len ? len : 1, sizeof(uint32_t));
+  return a;
+}
+
+/* Drop leading zero limbs, giving zero a sign of 0 */
+static void lbig_trim(lbig* a) {
+  while (a->len > 0 && a->d[a->len-1] == 0) { a->len--; }
+  if (a->len == 0) { a->sign = 0; }
+}
+
+/* View of a long as a big number, using "tmp" for the limbs */
+static lbig lbig_of_long(long x, uint32_t tmp[2]) {
+  unsigned long m = (x < 0) ? -(unsigned long) x : (unsigned long) x;
+  lbig a;
+  a.sign = (x > 0) - (x < 0);
+  a.d = tmp;
+  tmp[0] = (uint32_t) m;
+  tmp[1] = (uint32_t) ((uint64_t) m >> 32);
+  a.len = 2;
+  lbig_trim(&a);
+  return a;
+}
+
+/* View of a numeric lval as a big number */
+static lbig lval_as_big(lval* v, uint32_t tmp[2]) {
+  return (v->type == LVAL_BIG) ? v->big : lbig_of_long(v->num, tmp);
+}
+
+/* Compare magnitudes */
+static int mag_cmp(const uint32_t* a, int alen, const uint32_t* b, int blen) {
+  while (alen > 0 && a[alen-1] == 0) { alen--; }
+  while (blen > 0 && b[blen-1] == 0) { blen--; }
+  if (alen != blen) { return (alen > blen) ? 1 : -1; }
+  for (int i = alen-1; i >= 0; i--) {
+    if (a[i] != b[i]) { return (a[i] > b[i]) ? 1 : -1; }
+  }
+  return 0;
+}
+
+/* r[0 .. rlen) += x[0 .. xlen), carrying as far as needed */
+static void mag_add_into(uint32_t* r, int rlen, const uint32_t* x, int xlen) {
+  uint64_t carry = 0;
+  int i = 0;
+  for (; i < xlen; i++) {
+    carry += (uint64_t) r[i] + x[i];
+    r[i] = (uint32_t) carry;
+    carry >>= 32;
+  }
+  for (; carry && i < rlen; i++) {
+    carry += r[i];
+    r[i] = (uint32_t) carry;
+    carry >>= 32;
+  }
+}
+
+/* r[0 .. rlen) -= x[0 .. xlen), which must not be larger */
+static void mag_sub_into(uint32_t* r, int rlen, const uint32_t* x, int xlen) {
+  int64_t borrow = 0;
+  int i = 0;
+  for (; i < xlen; i++) {
+    int64_t t = (int64_t) r[i] - x[i] - borrow;
+    r[i] = (uint32_t) t;
+    borrow = (t < 0);
+  }
+  for (; borrow && i < rlen; i++) {
+    int64_t t = (int64_t) r[i] - borrow;
+    r[i] = (uint32_t) t;
+    borrow = (t < 0);
+  }
+}
+
+/* r[0 .. alen+blen) = a * b, with r zeroed by the caller */
+static void mag_mul(uint32_t* r, const uint32_t* a, int alen,
+		    const uint32_t* b, int blen) {
+
+  /* Keep "a" the longer operand */
+  if (alen < blen) {
+    const uint32_t* t = a; a = b; b = t;
+    int n = alen; alen = blen; blen = n;
+  }
+  if (blen >= LBIG_CHECK_LIMBS && lbudget_expired()) { return; }
+
+  /* Schoolbook multiplication for short operands */
+  if (blen < KARATSUBA_THRESHOLD) {
+    for (int i = 0; i < blen; i++) {
+      uint64_t carry = 0;
+      for (int j = 0; j < alen; j++) {
+	carry += (uint64_t) b[i] * a[j] + r[i+j];
+	r[i+j] = (uint32_t) carry;
+	carry >>= 32;
+      }
+      r[i+alen] = (uint32_t) carry;
+    }
+    return;
+  }
+
+  /* Unbalanced operands: multiply "b" by "a" in pieces of its own size */
+  if (2 * blen <= alen) {
+    uint32_t* t = malloc(sizeof(uint32_t) * 2 * blen);
+    for (int i = 0; i < alen; i += blen) {
+      int n = (alen - i < blen) ? alen - i : blen;
+      memset(t, 0, sizeof(uint32_t) * (n + blen));
+      mag_mul(t, a + i, n, b, blen);
+      mag_add_into(r + i, alen + blen - i, t, n + blen);
+    }
+    free(t);
+    return;
+  }
+
+  /* Karatsuba: with a = a1 B + a0 and b = b1 B + b0, the middle term */
+  /* a1 b0 + a0 b1 is (a0 + a1)(b0 + b1) - a0 b0 - a1 b1 */
+  int m = alen / 2;
+  const uint32_t *a0 = a, *a1 = a + m, *b0 = b, *b1 = b + m;
+  int a1len = alen - m, b1len = blen - m;
+
+  mag_mul(r, a0, m, b0, m);
+  mag_mul(r + 2*m, a1, a1len, b1, b1len);
+
+  int salen = (a1len > m ? a1len : m) + 1;
+  int sblen = (b1len > m ? b1len : m) + 1;
+  uint32_t* sa = calloc(salen, sizeof(uint32_t));
+  uint32_t* sb = calloc(sblen, sizeof(uint32_t));
+  memcpy(sa, a1, sizeof(uint32_t) * a1len);
+  memcpy(sb, b1, sizeof(uint32_t) * b1len);
+  mag_add_into(sa, salen, a0, m);
+  mag_add_into(sb, sblen, b0, m);
+
+  uint32_t* z1 = calloc(salen + sblen, sizeof(uint32_t));
+  mag_mul(z1, sa, salen, sb, sblen);
+  mag_sub_into(z1, salen + sblen, r, 2*m);
+  mag_sub_into(z1, salen + sblen, r + 2*m, a1len + b1len);
+  mag_add_into(r + m, alen + blen - m, z1,
+	       (salen + sblen < alen + blen - m) ? salen + sblen : alen + blen - m);
+
+  free(sa);
+  free(sb);
+  free(z1);
+}
+
+/* Divide a magnitude in place by a single limb, returning the remainder */
+static uint32_t mag_divmod_small(uint32_t* a, int alen, uint32_t d) {
+  uint64_t rem = 0;
+  for (int i = alen-1; i >= 0; i--) {
+    uint64_t cur = (rem << 32) | a[i];
+    a[i] = (uint32_t) (cur / d);
+    rem = cur % d;
+  }
+  return (uint32_t) rem;
+}
+
+/* q = a / b and r = a % b on magnitudes, following Knuth's algorithm D. */
+/* "q" has room for alen - blen + 1 limbs and "r" for blen limbs, both */
+/* zeroed; the top limb of "b" is not zero and alen >= blen. */
+static void mag_divmod(uint32_t* q, uint32_t* r, const uint32_t* a, int alen,
+		       const uint32_t* b, int blen) {
+
+  if (blen == 1) {
+    memcpy(q, a, sizeof(uint32_t) * alen);
+    r[0] = mag_divmod_small(q, alen, b[0]);
+    return;
+  }
+
+  /* Normalise so that the top limb of the divisor has its high bit set */
+  int s = __builtin_clz(b[blen-1]);
+  uint32_t* bn = malloc(sizeof(uint32_t) * blen);
+  uint32_t* an = malloc(sizeof(uint32_t) * (alen + 1));
+  for (int i = blen-1; i > 0; i--) {
+    bn[i] = (b[i] << s) | (uint32_t) ((uint64_t) b[i-1] >> (32 - s));
+  }
+  bn[0] = b[0] << s;
+  an[alen] = (uint32_t) ((uint64_t) a[alen-1] >> (32 - s));
+  for (int i = alen-1; i > 0; i--) {
+    an[i] = (a[i] << s) | (uint32_t) ((uint64_t) a[i-1] >> (32 - s));
+  }
+  an[0] = a[0] << s;
+
+  for (int j = alen - blen; j >= 0; j--) {
+    if (blen >= LBIG_CHECK_LIMBS && (j & 255) == 0 && lbudget_expired()) {
+      break;
+    }
+
+    /* Estimate the quotient limb from the top two limbs, then correct */
+    uint64_t num = ((uint64_t) an[j+blen] << 32) | an[j+blen-1];
+    uint64_t qhat = num / bn[blen-1];
+    uint64_t rhat = num % bn[blen-1];
+    while (qhat >> 32 ||
+	   qhat * bn[blen-2] > ((rhat << 32) | an[j+blen-2])) {
+      qhat--;
+      rhat += bn[blen-1];
+      if (rhat >> 32) { break; }
+    }
+
+    /* Multiply and subtract */
+    int64_t k = 0;
+    int64_t t;
+    for (int i = 0; i < blen; i++) {
+      uint64_t p = qhat * bn[i];
+      t = (int64_t) an[i+j] - k - (int64_t) (p & 0xFFFFFFFFu);
+      an[i+j] = (uint32_t) t;
+      k = (int64_t) (p >> 32) - (t >> 32);
+    }
+    t = (int64_t) an[j+blen] - k;
+    an[j+blen] = (uint32_t) t;
+
+    /* Add back if the estimate was one too large */
+    q[j] = (uint32_t) qhat;
+    if (t < 0) {
+      q[j]--;
+      uint64_t c = 0;
+      for (int i = 0; i < blen; i++) {
+	c += (uint64_t) an[i+j] + bn[i];
+	an[i+j] = (uint32_t) c;
+	c >>= 32;
+      }
+      an[j+blen] += (uint32_t) c;
+    }
+  }
+
+  /* Undo the normalisation of the remainder */
+  for (int i = 0; i < blen; i++) {
+    r[i] = (an[i] >> s) | (uint32_t) ((uint64_t) an[i+1] << (32 - s));
+  }
+
+  free(bn);
+  free(an);
+}
+
+static lbig lbig_add(lbig a, lbig b) {
+  int len = (a.len > b.len ? a.len : b.len) + 1;
+  lbig r = lbig_alloc(len);
+
+  if (a.sign == b.sign || a.sign == 0 || b.sign == 0) {
+    /* Same signs add magnitudes */
+    memcpy(r.d, a.d, sizeof(uint32_t) * a.len);
+    mag_add_into(r.d, len, b.d, b.len);
+    r.sign = a.sign ? a.sign : b.sign;
+  } else if (mag_cmp(a.d, a.len, b.d, b.len) >= 0) {
+    /* Otherwise subtract the smaller magnitude from the larger */
+    memcpy(r.d, a.d, sizeof(uint32_t) * a.len);
+    mag_sub_into(r.d, len, b.d, b.len);
+    r.sign = a.sign;
+  } else {
+    memcpy(r.d, b.d, sizeof(uint32_t) * b.len);
+    mag_sub_into(r.d, len, a.d, a.len);
+    r.sign = b.sign;
+  }
+
+  lbig_trim(&r);
+  return r;
+}
+
+static lbig lbig_sub(lbig a, lbig b) {
+  b.sign = -b.sign;
+  return lbig_add(a, b);
+}
+
+static lbig lbig_mul(lbig a, lbig b) {
+  lbig r = lbig_alloc(a.len + b.len);
+  if (a.sign && b.sign) { mag_mul(r.d, a.d, a.len, b.d, b.len); }
+  r.sign = a.sign * b.sign;
+  lbig_trim(&r);
+  return r;
+}
+
+/* Truncating division, like C: the quotient rounds towards zero and the */
+/* remainder takes the sign of the dividend. "b" must not be zero. */
+static void lbig_divmod(lbig a, lbig b, lbig* q, lbig* r) {
+  if (mag_cmp(a.d, a.len, b.d, b.len) < 0) {
+    *q = lbig_alloc(0);
+    *r = lbig_alloc(a.len);
+    memcpy(r->d, a.d, sizeof(uint32_t) * a.len);
+    r->sign = a.sign;
+    lbig_trim(r);
+    return;
+  }
+
+  *q = lbig_alloc(a.len - b.len + 1);
+  *r = lbig_alloc(b.len);
+  mag_divmod(q->d, r->d, a.d, a.len, b.d, b.len);
+  q->sign = a.sign * b.sign;
+  r->sign = a.sign;
+  lbig_trim(q);
+  lbig_trim(r);
+}
+
+/* Exact power by repeated squaring */
+static lbig lbig_pow(lbig a, unsigned long n) {
+  lbig r = lbig_alloc(1);
+  r.d[0] = 1;
+  r.sign = 1;
+  lbig base = lbig_alloc(a.len);
+  memcpy(base.d, a.d, sizeof(uint32_t) * a.len);
+  base.sign = a.sign;
+  while (n) {
+    if (n & 1) {
+      lbig t = lbig_mul(r, base);
+      free(r.d);
+      r = t;
+    }
+    n >>= 1;
+    if (n) {
+      lbig t = lbig_mul(base, base);
+      free(base.d);
+      base = t;
+    }
+  }
+  free(base.d);
+  return r;
+}
+
+/* Number of significant bits in the magnitude */
+static long lbig_bits(lbig a) {
+  if (a.len == 0) { return 0; }
+  return (long) a.len * 32 - __builtin_clz(a.d[a.len-1]);
+}
+
+/* Signed comparison */
+static int lbig_cmp(lbig a, lbig b) {
+  if (a.sign != b.sign) { return (a.sign > b.sign) ? 1 : -1; }
+  return a.sign * mag_cmp(a.d, a.len, b.d, b.len);
+}
+
+/* Parse an optionally negative string of decimal digits */
+static lbig lbig_read(const char* s) {
+  int neg = (*s == '-');
+  if (neg) { s++; }
+  int ndigits = strlen(s);
+
+  /* Every limb holds more than nine decimal digits */
+  lbig r = lbig_alloc(ndigits / LBIG_DEC_DIGITS + 2);
+  r.len = 0;
+
+  /* Consume the digits nine at a time: r = r * 10^9 + chunk */
+  int first = ndigits % LBIG_DEC_DIGITS;
+  if (first == 0) { first = LBIG_DEC_DIGITS; }
+  for (int i = 0; i < ndigits; ) {
+    int n = (i == 0) ? first : LBIG_DEC_DIGITS;
+    uint32_t chunk = 0;
+    uint32_t scale = 1;
+    for (int k = 0; k < n; k++, i++) {
+      chunk = chunk * 10 + (s[i] - '0');
+      scale *= 10;
+    }
+    uint64_t carry = chunk;
+    for (int k = 0; k < r.len; k++) {
+      carry += (uint64_t) r.d[k] * scale;
+      r.d[k] = (uint32_t) carry;
+      carry >>= 32;
+    }
+    if (carry) { r.d[r.len++] = (uint32_t) carry; }
+  }
+
+  r.sign = neg ? -1 : 1;
+  lbig_trim(&r);
+  return r;
+}
+
+/* Decimal representation as a newly allocated string */
+static char* lbig_str(lbig a) {
+  if (a.sign == 0) {
+    char* s = malloc(2);
+    strcpy(s, "0");
+    return s;
+  }
+
+  /* Peel off base 10^9 chunks, least significant first. There is */
+  /* always at least one, so the leading chunk below is always set. */
+  uint32_t* t = malloc(sizeof(uint32_t) * a.len);
+  memcpy(t, a.d, sizeof(uint32_t) * a.len);
+  int tlen = a.len;
+  uint32_t* chunks = malloc(sizeof(uint32_t) * (a.len * 2 + 1));
+  int n = 0;
+  do {
+    chunks[n++] = (tlen > 0) ? mag_divmod_small(t, tlen, LBIG_DEC_BASE) : 0;
+    while (tlen > 0 && t[tlen-1] == 0) { tlen--; }
+  } while (tlen > 0);
+
+  char* s = malloc(n * LBIG_DEC_DIGITS + 2);
+  char* p = s;
+  if (a.sign < 0) { *p++ = '-'; }
+  p += sprintf(p, "%u", chunks[n-1]);
+  for (int i = n-2; i >= 0; i--) {
+    p += sprintf(p, "%09u", chunks[i]);
+  }
+
+  free(t);
+  free(chunks);
+  return s;
+}
+
+/* Turn a big number result into an lval, taking ownership of it. Results */
+/* that fit in a long become plain Numbers again. */
+lval* lval_big(lbig a) {
+  if (a.len <= 2) {
+    uint64_t m = a.len ? a.d[0] : 0;
+    if (a.len == 2) { m |= (uint64_t) a.d[1] << 32; }
+    if (m <= (uint64_t) LONG_MAX || (a.sign < 0 && m == (uint64_t) LONG_MAX + 1)) {
+      long x = (a.sign < 0) ? -(long) (m - 1) - 1 : (long) m;
+      free(a.d);
+      return lval_num(x);
+    }
+  }
+  lval* v = lval_new(LVAL_BIG);
+  v->big = a;
+  lbudget_charge((long) a.len * sizeof(uint32_t));
+  return v;
+}
+
+/* Apply arithmetic operator "op" to two numbers of which at least one */
+/* is, or just overflowed into, a big number. Consumes "x" only. */
+lval* lval_big_op(lval* x, lval* y, char* op) {
+  uint32_t xt[2], yt[2];
+  lbig a = lval_as_big(x, xt);
+  lbig b = lval_as_big(y, yt);
+  lval* r = NULL;
+
+  if (strcmp(op, "+") == 0) { r = lval_big(lbig_add(a, b)); }
+  if (strcmp(op, "-") == 0) { r = lval_big(lbig_sub(a, b)); }
+  if (strcmp(op, "*") == 0) { r = lval_big(lbig_mul(a, b)); }
+  if (strcmp(op, "/") == 0 || strcmp(op, "%") == 0) {
+    if (b.sign == 0) {
+      r = lval_err("Division by zero!");
+    } else {
+      lbig q, m;
+      lbig_divmod(a, b, &q, &m);
+      if (strcmp(op, "/") == 0) {
+	r = lval_big(q);
+	free(m.d);
+      } else {
+	r = lval_big(m);
+	free(q.d);
+      }
+    }
+  }
+  if (strcmp(op, "^") == 0) {
+    /* Powers of 0, 1 and -1 of any size are known without computing them */
+    int unit = (a.len == 1 && a.d[0] == 1);
+    int odd = (b.len > 0) && (b.d[0] & 1);
+    if (a.sign == 0) {
+      r = (b.sign < 0) ? lval_err("Division by zero!") : lval_num(b.sign == 0);
+    } else if (unit) {
+      r = lval_num((a.sign < 0 && odd) ? -1 : 1);
+    } else if (b.sign < 0) {
+      /* Other bases have no integer powers with negative exponents */
+      r = lval_num(0);
+    } else {
+      /* The result has at most bits(x) * y bits, checked before any of */
+      /* them are computed */
+      double bits = (y->type == LVAL_BIG)
+	? INFINITY : (double) lbig_bits(a) * y->num;
+      if (bits > (double) INT_MAX * 16) {
+	r = lval_err("Exponent too large!");
+      } else {
+	r = lbudget_reserve(bits / 8);
+	if (!r) { r = lval_big(lbig_pow(a, y->num)); }
+      }
+    }
+  }
+  if (strcmp(op, "min") == 0) {
+    r = lval_copy(lbig_cmp(a, b) <= 0 ? x : y);
+  }
+  if (strcmp(op, "max") == 0) {
+    r = lval_copy(lbig_cmp(a, b) >= 0 ? x : y);
+  }
+
+  /* A result cut short by the budget is meaningless */
+  if (lbudget_cur && lbudget_cur->spent && r->type != LVAL_ERR) {
+    lval_del(r);
+    r = lbudget_check();
+  }
+
+  lval_del(x);
+  return r;
+}
+
+/* Nearest double to a big number */
+static double lbig_to_double(lbig a) {
+  double d = 0;
+  for (int i = a.len-1; i >= 0; i--) { d = ldexp(d, 32) + a.d[i]; }
+  return a.sign * d;
+}
+
+/* Power of two longs, returning non-zero if the result overflows */
+static int lpow_overflow(long x, long n, long* r) {
+  if (n < 0) {
+    /* Negative exponents truncate to zero except for 1 and -1 */
+    *r = (x == 1) ? 1 : (x == -1) ? ((n & 1) ? -1 : 1) : 0;
+    return 0;
+  }
+  long acc = 1;
+  while (n) {
+    if ((n & 1) && __builtin_mul_overflow(acc, x, &acc)) { return 1; }
+    n >>= 1;
+    if (n && __builtin_mul_overflow(x, x, &x)) { return 1; }
+  }
+  *r = acc;
+  return 0;
+}
+
+/**************************************************************************/
+/******************** PRINTING ********************************************/
+/**************************************************************************/
+
+void lval_fprint(FILE* out, lval* v);
+
+/* A list being printed together with the index of its next element */
+typedef struct {
+  lval* v;
+  int i;
+} lprint_frame;
+
+/* Print a list using an explicit stack of the lists still open */
+void lval_print_expr(FILE* out, lval* v) {
+  int cap = 16;
+  int n = 0;
+  lprint_frame* stack = malloc(sizeof(lprint_frame) * cap);
+
+  fputc(v->type == LVAL_SEXPR ? '(' : '{', out);
+  stack[n].v = v;
+  stack[n].i = 0;
+  n++;
+
+  while (n > 0) {
+    lprint_frame* f = &stack[n-1];
+
+    /* Close the list once all its elements are printed */
+    if (f->i == f->v->count) {
+      fputc(f->v->type == LVAL_SEXPR ? ')' : '}', out);
+      n--;
+      continue;
+    }
+
+    /* Don't print trailing space if last element */
+    if (f->i > 0) { fputc(' ', out); }
+    lval* x = f->v->cell[f->i++];
+
+    /* Descend into nested lists, print anything else directly */
+    if (!LVAL_IS_LIST(x)) {
+      lval_fprint(out, x);
+      continue;
+    }
+    if (n == cap) {
+      cap *= 2;
+      stack = realloc(stack, sizeof(lprint_frame) * cap);
+    }
+    fputc(x->type == LVAL_SEXPR ? '(' : '{', out);
+    stack[n].v = x;
+    stack[n].i = 0;
+    n++;
+  }
+
+  free(stack);
+}
+
+void lflt_print(FILE* out, double x);
+
+/* Print an array as a bracketed list of rows */
+void lval_print_arr(FILE* out, lval* v) {
+  fputc('[', out);
+  for (int i = 0; i < v->rows; i++) {
+    fputc('[', out);
+    for (int j = 0; j < v->cols; j++) {
+      if (v->elem == LVAL_FLT) { lflt_print(out, v->fdata[i * v->cols + j]); }
+      else { fprintf(out, "%li", v->data[i * v->cols + j]); }
+      if (j != v->cols-1) { fputc(' ', out); }
+    }
+    fputc(']', out);
+    if (i != v->rows-1) { fputc(' ', out); }
+  }
+  fputc(']', out);
+}
+
+/* Print a map as its keys and values in a #{} list. Maps never hold */
+/* other maps, so this cannot loop. */
+void lval_print_hmap(FILE* out, lval* v) {
+  lhmap* m = v->map;
+  int first = 1;
+  pthread_mutex_lock(&m->lock);
+  fputs("#{", out);
+  for (int i = 0; i < m->cap; i++) {
+    if (!m->slots[i].key) { continue; }
+    if (!first) { fputc(' ', out); }
+    lval_fprint(out, m->slots[i].key);
+    fputc(' ', out);
+    lval_fprint(out, m->slots[i].val);
+    first = 0;
+  }
+  fputc('}', out);
+  pthread_mutex_unlock(&m->lock);
+}
+
+/* Print a big number in decimal */
+void lval_print_big(FILE* out, lval* v) {
+  char* s = lbig_str(v->big);
+  fputs(s, out);
+  free(s);
+}
+
+/* Print a float with the fewest digits that read back the same value, */
+/* keeping a decimal point so that it still reads as a float */
+void lflt_print(FILE* out, double x) {
+  char buf[32];
+  for (int digits = 15; digits <= 17; digits++) {
+    snprintf(buf, sizeof(buf), "%.*g", digits, x);
+    if (strtod(buf, NULL) == x) { break; }
+  }
+  fputs(buf, out);
+  if (!strpbrk(buf, ".eni")) { fputs(".0", out); }
+}
+
+void lval_print_flt(FILE* out, lval* v) {
+  lflt_print(out, v->flt);
+}
+
+/* Print an "lval" to "out" */
+void lval_fprint(FILE* out, lval* v) {
+  switch (v->type) {
+    case LVAL_NUM:   fprintf(out, "%li", v->num); break;
+    case LVAL_ERR:   fprintf(out, "Error: %s", v->err); break;
+    case LVAL_SYM:   fprintf(out, "%s", v->sym); break;
+    case LVAL_FUN:   fprintf(out, "<function>"); break;
+    case LVAL_SEXPR:
+    case LVAL_QEXPR: lval_print_expr(out, v); break;
+    case LVAL_ARR:   lval_print_arr(out, v); break;
+    case LVAL_HMAP:  lval_print_hmap(out, v); break;
+    case LVAL_BIG:   lval_print_big(out, v); break;
+    case LVAL_FLT:   lval_print_flt(out, v); break;
+    case LVAL_SEQ:   fprintf(out, "<sequence>"); break;
+    case LVAL_FUT:   fprintf(out, "<future>"); break;
+    case LVAL_CHAN:  fprintf(out, "<channel>"); break;
+    case LVAL_CO:    fprintf(out, "<coroutine>"); break;
+    case LVAL_RANGE:
+      fprintf(out, "<range of %i from %li by %li>", v->count, v->num, v->step);
+      break;
+  }
+}
+
+/* Print an "lval" to "out" followed by a newline */
+void lval_fprintln(FILE* out, lval* v) {
+  lval_fprint(out, v);
+  fputc('\n', out);
+}
+
+/* Print an "lval" */
+void lval_print(lval* v) {
+  lval_fprint(stdout, v);
+}
+
+/* Print an "lval" followed by a newline */
+void lval_println(lval* v) {
+  lval_fprintln(stdout, v);
+}
+
+/* The printed form of an "lval", to be freed by the caller */
+char* lval_to_str(lval* v) {
+  char* str;
+  size_t size;
+  FILE* out = open_memstream(&str, &size);
+  if (!out) { return NULL; }
+  lval_fprint(out, v);
+  fclose(out);
+  return str;
+}
+
+char* ltype_name(int t) {
+  switch (t) {
+    case LVAL_ERR: return "Error";
+    case LVAL_NUM: return "Number";
+    case LVAL_SYM: return "Symbol";
+    case LVAL_FUN: return "Function";
+    case LVAL_SEXPR: return "S-Expression";
+    case LVAL_QEXPR: return "Q-Expression";
+    case LVAL_ARR: return "Array";
+    case LVAL_HMAP: return "Hash Map";
+    case LVAL_BIG: return "Big Number";
+    case LVAL_FLT: return "Float";
+    case LVAL_SEQ: return "Sequence";
+    case LVAL_RANGE: return "Range";
+    case LVAL_FUT: return "Future";
+    case LVAL_CHAN: return "Channel";
+    case LVAL_CO: return "Coroutine";
+    default: return "Unknown";
+  }
+}
+
+/**************************************************************************/
+/******************** LIST ENVIRONMENT ************************************/
+/**************************************************************************/
+
+/* Declare new lenv struct */
+struct lenv {
+  int count;
+  char** syms;
+  lval** vals;
+  /* Frozen environment consulted for symbols not bound here, if any */
+  lenv* par;
+};
+
+lenv* lenv_new(void) {
+  lenv* e = malloc(sizeof(lenv));
+  e->count = 0;
+  e->syms = NULL;
   e->vals = NULL;
+  e->par = NULL;
   return e;
 }
 
@@ -325,6 +2066,21 @@ void lenv_del(lenv* e) {
   free(e);
 }
 
+/* Copy every binding of "e" into a new environment with the same parent */
+lenv* lenv_copy(lenv* e) {
+  lenv* n = malloc(sizeof(lenv));
+  n->par = e->par;
+  n->count = e->count;
+  n->syms = malloc(sizeof(char*) * e->count);
+  n->vals = malloc(sizeof(lval*) * e->count);
+  for (int i = 0; i < e->count; i++) {
+    n->syms[i] = malloc(strlen(e->syms[i]) + 1);
+    strcpy(n->syms[i], e->syms[i]);
+    n->vals[i] = lval_copy(e->vals[i]);
+  }
+  return n;
+}
+
 lval* lenv_get(lenv* e, lval* k) {
 
   /* Iterate over all itemsn in environment */
@@ -336,11 +2092,22 @@ lval* lenv_get(lenv* e, lval* k) {
     }
   }
 
+  /* Otherwise look in the parent */
+  if (e->par) { return lenv_get(e->par, k); }
+
   /* If no symbol was found, return error */
   return lval_err("Unbound Symbol '%s'!", k->sym);
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
+/* The value bound to "k" without copying it, or NULL if it is unbound */
+lval* lenv_peek(lenv* e, lval* k) {
+  for (int i = 0; i < e->count; i++) {
+    if (strcmp(e->syms[i], k->sym) == 0) { return e->vals[i]; }
+  }
+  return e->par ? lenv_peek(e->par, k) : NULL;
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
 
   /* Iterate over all items in environment */
   /* This is to see if the variable already exists */
@@ -366,269 +2133,3526 @@ void lenv_put(lenv* e, lval* k, lval* v) {
   strcpy(e->syms[e->count-1], k->sym);
 }
 
+/* Freeze every value bound in "e" for good. The environment must not */
+/* change afterwards, and may then be shared as the parent of any number */
+/* of environments on any threads, which read it without copying it. */
+void lenv_freeze(lenv* e) {
+  for (int i = 0; i < e->count; i++) { e->vals[i] = lval_perm(e->vals[i]); }
+}
+
 /**************************************************************************/
 /******************** BUILTINS ********************************************/
 /**************************************************************************/
 
-#define LASSERT(args, cond, fmt, ...) \
-  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); \
-    lval_del(args); return err; }
+#define LASSERT(args, cond, fmt, ...) \
+  if (!(cond)) { lval* err = lval_err(fmt, ##__VA_ARGS__); \
+    lval_del(args); return err; }
+
+/* Argument "i" of "a", with a range expanded into a list when a */
+/* Q-Expression is expected there */
+lval* lval_arg_as(lval* a, int i, int expect) {
+  if (expect == LVAL_QEXPR && a->cell[i]->type == LVAL_RANGE) {
+    lval* q = lrange_list(a->cell[i]);
+    lval_del(a->cell[i]);
+    a->cell[i] = q;
+  }
+  return a->cell[i];
+}
+
+#define LASSERT_TYPE(func, args, index, expect) \
+  LASSERT(args, lval_arg_as(args, index, expect)->type == expect,\
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",\
+	  func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+
+#define LASSERT_NUM(func, args, num) \
+  LASSERT(args, args->count == num, \
+    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.",\
+    func, args->count, num);
+
+/* A Q-Expression or a range, which is left as it is */
+#define LASSERT_LIST(func, args, index) \
+  LASSERT(args, args->cell[index]->type == LVAL_QEXPR \
+    || args->cell[index]->type == LVAL_RANGE, \
+    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",\
+    func, index, ltype_name(args->cell[index]->type), ltype_name(LVAL_QEXPR))
+
+/* Only lists and ranges have a count, so any other value is not empty */
+#define LASSERT_NOT_EMPTY(func, args, index) \
+  LASSERT(args, !(LVAL_IS_LIST(args->cell[index]) \
+		  || args->cell[index]->type == LVAL_RANGE) \
+	  || args->cell[index]->count != 0, \
+	  "Function '%s' passed {} for argument %i.", func, index);
+
+#define LASSERT_SEQ(func, args, index) \
+  LASSERT(args, args->cell[index]->type == LVAL_SEQ \
+    || args->cell[index]->type == LVAL_QEXPR \
+    || args->cell[index]->type == LVAL_RANGE, \
+    "Function '%s' passed incorrect type for argument %i. " \
+    "Got %s, Expected %s or %s.", func, index, \
+    ltype_name(args->cell[index]->type), \
+    ltype_name(LVAL_SEQ), ltype_name(LVAL_QEXPR))
+
+#define LASSERT_FINITE(func, args, index) \
+  LASSERT(args, lseq_finite(args->cell[index]->seq), \
+    "Function '%s' passed an endless sequence for argument %i.", func, index)
+
+lval* lval_eval(lenv* e, lval* v);
+lval* lval_call(lenv* e, lval* f, lval* a);
+int lseq_finite(lseq* s);
+lval* lseq_fold(lenv* e, lval* f, lval* acc, lseq* s);
+lseq* lseq_of(lval* v);
+
+lval* builtin_head(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("head", a, 1);
+  LASSERT_LIST("head", a, 0);
+  LASSERT_NOT_EMPTY("head", a, 0);
+
+  /* Otherwise take first argument */
+  lval* v = lval_take(a, 0);
+  if (v->type == LVAL_RANGE) {
+    lval* x = lval_add(lval_qexpr(), lval_num(v->num));
+    lval_del(v);
+    return x;
+  }
+
+  /* Delete all elements that are not head and return */
+  for (int i = 1; i < v->count; i++) { lval_del(v->cell[i]); }
+  v->count = 1;
+  return v;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("tail", a, 1);
+  LASSERT_LIST("tail", a, 0);
+  LASSERT_NOT_EMPTY("tail", a, 0);
+
+  /* Take first argument */
+  lval* v = lval_take(a, 0);
+  if (v->type == LVAL_RANGE) {
+    v->num = lrange_at(v, 1);
+    v->count--;
+    return v;
+  }
+
+  /* Delete first element and return */
+  lval_del(lval_pop(v, 0));
+  return v;
+}
+
+lval* builtin_list(lenv* e, lval* a) {
+  a->type = LVAL_QEXPR;
+  return a;
+}
+
+lval* builtin_eval(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("eval", a, 1);
+  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+
+  lval* x = lval_take(a, 0);
+  x->type = LVAL_SEXPR;
+  return lval_eval(e, x);
+}
+
+lval* builtin_join_co(lenv* e, lval* a);
+
+lval* builtin_join(lenv* e, lval* a) {
+
+  /* Joining a single coroutine waits for its value */
+  if (a->count == 1 && a->cell[0]->type == LVAL_CO) {
+    return builtin_join_co(e, a);
+  }
+
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+  }
+
+  lval* x = lval_pop(a, 0);
+
+  while (a->count) {
+    x = lval_join(x, lval_pop(a, 0));
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_cons(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("cons", a, 2);
+  LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("cons", a, 0);
+  
+  /* Construct new Q-expr */
+  lval* x = lval_qexpr();
+  /* Add the value */
+  x = lval_add(x, lval_pop(a, 0));
+  /* Add the elements of the Q-expr */
+  lval* q = lval_take(a, 0);
+  while (q->count) {
+    x = lval_add(x, lval_pop(q, 0));
+  }
+  
+  lval_del(q);
+  return x;
+};
+
+lval* builtin_len(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("len", a, 1);
+  LASSERT_LIST("len", a, 0);
+  LASSERT_NOT_EMPTY("len", a, 0);
+
+  lval* x = lval_num(a->cell[0]->count);
+  lval_del(a);
+  return x;
+};
+
+lval* builtin_init(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("init", a, 1);
+  LASSERT_LIST("init", a, 0);
+  LASSERT_NOT_EMPTY("init", a, 0);
+
+  /* Take first argument */
+  lval* v = lval_take(a, 0);
+  if (v->type == LVAL_RANGE) {
+    v->count--;
+    return v;
+  }
+
+  /* Delete last element and return */
+  lval_del(lval_pop(v, v->count-1));
+  return v;
+}
+
+lval* builtin_last(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("last", a, 1);
+  LASSERT_LIST("last", a, 0);
+  LASSERT_NOT_EMPTY("last", a, 0);
+
+  /* Otherwise take first argument */
+  lval* v = lval_take(a, 0);
+  if (v->type == LVAL_RANGE) {
+    lval* x = lval_add(lval_qexpr(), lval_num(lrange_at(v, v->count-1)));
+    lval_del(v);
+    return x;
+  }
+
+  /* Delete all elements that are not last and return */
+  for (int i = 0; i < v->count-1; i++) { lval_del(v->cell[i]); }
+  v->cell[0] = v->cell[v->count-1];
+  v->count = 1;
+  return v;
+}
+
+lval* builtin_nth(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("nth", a, 2);
+  LASSERT_TYPE("nth", a, 0, LVAL_NUM);
+  LASSERT_LIST("nth", a, 1);
+  LASSERT(a, a->cell[0]->num >= 0 && a->cell[0]->num < a->cell[1]->count,
+    "Function 'nth' passed index %li for a list of %i elements.",
+    a->cell[0]->num, a->cell[1]->count);
+
+  long i = a->cell[0]->num;
+  lval* v = lval_take(a, 1);
+  if (v->type == LVAL_RANGE) {
+    lval* x = lval_num(lrange_at(v, i));
+    lval_del(v);
+    return x;
+  }
+
+  /* Move the element out and let the last one fill its place */
+  lval* x = v->cell[i];
+  v->cell[i] = v->cell[v->count-1];
+  v->count--;
+  lval_del(v);
+  return x;
+}
+
+/* Numbers from "start" up to but not including "stop", "step" apart */
+lval* builtin_range(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT(a, a->count >= 1 && a->count <= 3,
+    "Function 'range' passed incorrect number of arguments. "
+    "Got %i, Expected 1 to 3.", a->count);
+  for (int i = 0; i < a->count; i++) {
+    LASSERT_TYPE("range", a, i, LVAL_NUM);
+  }
+
+  long start = (a->count > 1) ? a->cell[0]->num : 0;
+  long stop = (a->count > 1) ? a->cell[1]->num : a->cell[0]->num;
+  long step = (a->count > 2) ? a->cell[2]->num : 1;
+  LASSERT(a, step != 0, "Function 'range' passed a step of 0.");
+
+  /* Count in unsigned arithmetic so that wide ranges cannot overflow */
+  unsigned long span = 0;
+  unsigned long by = 1;
+  if (step > 0 && stop > start) {
+    span = (unsigned long) stop - (unsigned long) start;
+    by = (unsigned long) step;
+  }
+  if (step < 0 && stop < start) {
+    span = (unsigned long) start - (unsigned long) stop;
+    by = -(unsigned long) step;
+  }
+  unsigned long count = span / by + (span % by != 0);
+  LASSERT(a, count <= INT_MAX,
+    "Function 'range' would hold %lu numbers, more than %i.", count, INT_MAX);
+
+  lval_del(a);
+  return lval_range(start, step, count);
+}
+
+int lpool_in_task(void);
+
+lval* builtin_def(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT(a, !lpool_in_task(),
+	  "Function 'def' cannot be used inside a parallel task.");
+  LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
+  
+  /* First argument is symbol list */
+  lval* syms = a->cell[0];
+
+  /* Ensure all elements of first list are symbols */
+  for (int i = 0; i < syms->count; i++) {
+    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
+	    "Function 'def' cannot define non-symbol! "
+	    "Got %s, Expected %s.",
+	    ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
+  }
+
+  /* Check correct number of symbols and values */
+  LASSERT(a, (syms->count == a->count-1),
+	  "Function 'def' passed too many arguments for symbols. "
+	  "Got %i, Expected %i.",
+	  syms->count, a->count-1);
+
+  /* Assign copies of values to symbols */
+  for (int i = 0; i < syms->count; i++) {
+    lenv_put(e, syms->cell[i], a->cell[i+1]);
+  }
+
+  lval_del(a);
+  return lval_sexpr();
+}
+
+lval* builtin_equal(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("equal?", a, 2);
+
+  lval* x = lval_num(lval_eq(a->cell[0], a->cell[1]));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_memo(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT(a, a->count == 1 || a->count == 2,
+	  "Function 'memo' passed incorrect number of arguments. "
+	  "Got %i, Expected 1 or 2.", a->count);
+  LASSERT_TYPE("memo", a, 0, LVAL_FUN);
+
+  int capacity = MEMO_DEFAULT_CAPACITY;
+  if (a->count == 2) {
+    LASSERT_TYPE("memo", a, 1, LVAL_NUM);
+    LASSERT(a, a->cell[1]->num > 0 && a->cell[1]->num <= (1 << 24),
+	    "Function 'memo' passed invalid capacity %li.", a->cell[1]->num);
+    capacity = a->cell[1]->num;
+  }
+
+  /* Wrap the same builtin with a fresh cache */
+  lval* f = lval_fun(a->cell[0]->fun);
+  f->memo = lmemo_new(capacity);
+  lval_del(a);
+  return f;
+}
+
+lval* builtin_memo_stats(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("memo-stats", a, 1);
+  LASSERT_TYPE("memo-stats", a, 0, LVAL_FUN);
+  LASSERT(a, a->cell[0]->memo != NULL,
+	  "Function 'memo-stats' passed a function that is not memoized.");
+
+  /* Return {hits misses size capacity} */
+  lmemo* m = a->cell[0]->memo;
+  lval* x = lval_qexpr();
+  pthread_mutex_lock(&m->lock);
+  x = lval_add(x, lval_num(m->hits));
+  x = lval_add(x, lval_num(m->misses));
+  x = lval_add(x, lval_num(m->count));
+  x = lval_add(x, lval_num(m->capacity));
+  pthread_mutex_unlock(&m->lock);
+  lval_del(a);
+  return x;
+}
+
+/* Value of any number as a double */
+double lval_to_double(lval* v) {
+  switch (v->type) {
+    case LVAL_FLT: return v->flt;
+    case LVAL_BIG: return lbig_to_double(v->big);
+    default: return (double) v->num;
+  }
+}
+
+/* Apply operator "op" to two floats */
+static double lflt_op(double x, double y, char* op) {
+  if (strcmp(op, "+") == 0) { return x + y; }
+  if (strcmp(op, "-") == 0) { return x - y; }
+  if (strcmp(op, "*") == 0) { return x * y; }
+  if (strcmp(op, "/") == 0) { return x / y; }
+  if (strcmp(op, "%") == 0) { return fmod(x, y); }
+  if (strcmp(op, "^") == 0) { return pow(x, y); }
+  if (strcmp(op, "min") == 0) { return (x < y) ? x : y; }
+  if (strcmp(op, "max") == 0) { return (x > y) ? x : y; }
+  return x;
+}
+
+lval* builtin_op(lenv* e, lval* a, char* op) {
+
+  /* Ensure all arguments are number */
+  for (int i = 0; i < a->count; i++) {
+    int t = a->cell[i]->type;
+    LASSERT(a, t == LVAL_NUM || t == LVAL_BIG || t == LVAL_FLT,
+	    "Function '%s' passed incorrect type for argument %i. "
+	    "Got %s, Expected %s.",
+	    op, i, ltype_name(t), ltype_name(LVAL_NUM));
+  }
+
+  /* The running result is kept unboxed in "n" or "f" while it is a long */
+  /* or a float, so that no value is allocated per step. Only big numbers */
+  /* live in an lval. */
+  int kind = a->cell[0]->type;
+  long n = (kind == LVAL_NUM) ? a->cell[0]->num : 0;
+  double f = (kind == LVAL_FLT) ? a->cell[0]->flt : 0;
+  lval* big = (kind == LVAL_BIG) ? lval_copy_node(a->cell[0]) : NULL;
+
+  /* If no arguments left and subtraction then perform unary negation */
+  if (strcmp(op, "-") == 0 && a->count == 1) {
+    if (kind == LVAL_FLT) { f = -f; }
+    if (kind == LVAL_BIG) { big->big.sign = -big->big.sign; }
+    if (kind == LVAL_NUM && n != LONG_MIN) { n = -n; }
+    if (kind == LVAL_NUM && n == LONG_MIN) {
+      big = lval_big_op(lval_num(0), a->cell[0], op);
+      kind = LVAL_BIG;
+    }
+  }
+
+  for (int i = 1; i < a->count; i++) {
+    lval* y = a->cell[i];
+
+    /* Big numbers are never zero, so only a plain 0 can divide by zero */
+    int by_zero = (strcmp(op, "/") == 0 || strcmp(op, "%") == 0)
+      && ((y->type == LVAL_NUM && y->num == 0) ||
+	  (y->type == LVAL_FLT && y->flt == 0));
+
+    /* Raising integer 0 to a negative power divides by zero too */
+    if (strcmp(op, "^") == 0 && kind == LVAL_NUM && n == 0) {
+      by_zero = (y->type == LVAL_NUM) ? y->num < 0
+	: (y->type == LVAL_BIG) ? y->big.sign < 0 : 0;
+    }
+
+    if (by_zero) {
+      if (big) { lval_del(big); }
+      lval_del(a);
+      return lval_err("Division by zero!");
+    }
+
+    /* Any float turns the rest of the operation into float arithmetic */
+    if (kind == LVAL_FLT || y->type == LVAL_FLT) {
+      if (kind == LVAL_NUM) { f = (double) n; }
+      if (kind == LVAL_BIG) {
+	f = lbig_to_double(big->big);
+	lval_del(big);
+	big = NULL;
+      }
+      kind = LVAL_FLT;
+      f = lflt_op(f, lval_to_double(y), op);
+      continue;
+    }
+
+    /* Stay on plain longs until an operation overflows */
+    if (kind == LVAL_NUM && y->type == LVAL_NUM) {
+      long r = 0;
+      int overflow = 0;
+      if (strcmp(op, "+") == 0) { overflow = __builtin_add_overflow(n, y->num, &r); }
+      if (strcmp(op, "-") == 0) { overflow = __builtin_sub_overflow(n, y->num, &r); }
+      if (strcmp(op, "*") == 0) { overflow = __builtin_mul_overflow(n, y->num, &r); }
+      if (strcmp(op, "/") == 0) {
+	overflow = (n == LONG_MIN && y->num == -1);
+	if (!overflow) { r = n / y->num; }
+      }
+      if (strcmp(op, "%") == 0) { r = (y->num == -1) ? 0 : n % y->num; }
+      if (strcmp(op, "^") == 0) { overflow = lpow_overflow(n, y->num, &r); }
+      if (strcmp(op, "min") == 0) { r = (n < y->num) ? n : y->num; }
+      if (strcmp(op, "max") == 0) { r = (n > y->num) ? n : y->num; }
+
+      if (!overflow) {
+	n = r;
+	continue;
+      }
+    }
+
+    /* Otherwise continue with big numbers */
+    if (kind == LVAL_NUM) { big = lval_num(n); }
+    big = lval_big_op(big, y, op);
+    if (big->type == LVAL_ERR) {
+      lval_del(a);
+      return big;
+    }
+
+    /* Results are normalised, so this may be back to a plain long */
+    kind = big->type;
+    if (kind == LVAL_NUM) {
+      n = big->num;
+      lval_del(big);
+      big = NULL;
+    }
+  }
+
+  lval_del(a);
+  if (kind == LVAL_FLT) { return lval_flt(f); }
+  if (kind == LVAL_BIG) { return big; }
+  return lval_num(n);
+}
+
+lval* builtin_add(lenv* e, lval* a) {
+  return builtin_op(e, a , "+");
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+  return builtin_op(e, a , "-");
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+  return builtin_op(e, a , "*");
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+  return builtin_op(e, a , "/");
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+  return builtin_op(e, a , "%");
+}
+
+lval* builtin_pow(lenv* e, lval* a) {
+  return builtin_op(e, a, "^");
+}
+
+lval* builtin_min(lenv* e, lval* a) {
+  return builtin_op(e, a , "min");
+}
+
+lval* builtin_max(lenv* e, lval* a) {
+  return builtin_op(e, a , "max");
+}
+
+/**************************************************************************/
+/******************** ARRAYS **********************************************/
+/**************************************************************************/
+
+/* SIMD vector of longs used by the array kernels, sized to the baseline */
+/* vector registers so the kernels need no target-specific flags */
+typedef long lvec __attribute__((vector_size(16)));
+#define LVEC_LEN ((int) (sizeof(lvec) / sizeof(long)))
+
+/* The same for arrays of floats */
+typedef double lfvec __attribute__((vector_size(16)));
+#define LFVEC_LEN ((int) (sizeof(lfvec) / sizeof(double)))
+
+/* Side of the square tiles used by the cache-blocked kernels */
+#define ARR_BLOCK 64
+
+/* Unaligned vector load and store */
+static lvec lvec_load(const long* p) {
+  lvec v;
+  memcpy(&v, p, sizeof(lvec));
+  return v;
+}
+
+static void lvec_store(long* p, lvec v) {
+  memcpy(p, &v, sizeof(lvec));
+}
+
+static lfvec lfvec_load(const double* p) {
+  lfvec v;
+  memcpy(&v, p, sizeof(lfvec));
+  return v;
+}
+
+static void lfvec_store(double* p, lfvec v) {
+  memcpy(p, &v, sizeof(lfvec));
+}
+
+/* Sum of x[i] * y[i] over n elements into "sum". Returns nonzero if any */
+/* step overflowed. The baseline vector registers have no multiply of */
+/* longs, so one checked pass beats bounding the elements first and then */
+/* summing in vectors. */
+static int arr_dot(const long* x, const long* y, int n, long* sum) {
+  long s = 0;
+  int overflow = 0;
+  for (int i = 0; i < n; i++) {
+    long p;
+    overflow |= __builtin_mul_overflow(x[i], y[i], &p);
+    overflow |= __builtin_add_overflow(s, p, &s);
+  }
+  *sum = s;
+  return overflow;
+}
+
+/* y[i] += alpha * x[i] over n elements, stopping at the first element */
+/* that overflows. Returns its index, or -1. */
+static int arr_axpy_checked(long alpha, const long* x, long* y, int n) {
+  for (int i = 0; i < n; i++) {
+    long p;
+    if (__builtin_mul_overflow(alpha, x[i], &p)
+	|| __builtin_add_overflow(y[i], p, &y[i])) { return i; }
+  }
+  return -1;
+}
+
+/* y[i] += alpha * x[i] over n elements, which must not overflow */
+static void arr_axpy(long alpha, const long* x, long* y, int n) {
+  int i = 0;
+  for (; i + LVEC_LEN <= n; i += LVEC_LEN) {
+    lvec_store(y + i, lvec_load(y + i) + alpha * lvec_load(x + i));
+  }
+  for (; i < n; i++) { y[i] += alpha * x[i]; }
+}
+
+/* c (n x m) += a (n x p) * b (p x m), all row-major. Tiles are walked so */
+/* that the current rows of b and c stay in cache while the inner loop */
+/* streams along them with the axpy kernel. */
+static void arr_matmul(const long* a, const long* b, long* c,
+		       int n, int p, int m) {
+  for (int ii = 0; ii < n; ii += ARR_BLOCK) {
+    int iend = (ii + ARR_BLOCK < n) ? ii + ARR_BLOCK : n;
+    for (int kk = 0; kk < p; kk += ARR_BLOCK) {
+      int kend = (kk + ARR_BLOCK < p) ? kk + ARR_BLOCK : p;
+      for (int jj = 0; jj < m; jj += ARR_BLOCK) {
+	int jlen = (jj + ARR_BLOCK < m) ? ARR_BLOCK : m - jj;
+	for (int i = ii; i < iend; i++) {
+	  for (int k = kk; k < kend; k++) {
+	    arr_axpy(a[i * p + k], &b[k * m + jj], &c[i * m + jj], jlen);
+	  }
+	}
+      }
+    }
+  }
+}
+
+/* The float kernels, which need no overflow checks. Sums are taken in */
+/* vector lanes, so they may round differently from a left to right sum. */
+static double arr_fdot(const double* x, const double* y, int n) {
+  lfvec acc = {0};
+  int i = 0;
+  for (; i + LFVEC_LEN <= n; i += LFVEC_LEN) {
+    acc += lfvec_load(x + i) * lfvec_load(y + i);
+  }
+  double sum = 0;
+  for (int k = 0; k < LFVEC_LEN; k++) { sum += acc[k]; }
+  for (; i < n; i++) { sum += x[i] * y[i]; }
+  return sum;
+}
+
+static void arr_faxpy(double alpha, const double* x, double* y, int n) {
+  int i = 0;
+  for (; i + LFVEC_LEN <= n; i += LFVEC_LEN) {
+    lfvec_store(y + i, lfvec_load(y + i) + alpha * lfvec_load(x + i));
+  }
+  for (; i < n; i++) { y[i] += alpha * x[i]; }
+}
+
+static void arr_fmatmul(const double* a, const double* b, double* c,
+			int n, int p, int m) {
+  for (int ii = 0; ii < n; ii += ARR_BLOCK) {
+    int iend = (ii + ARR_BLOCK < n) ? ii + ARR_BLOCK : n;
+    for (int kk = 0; kk < p; kk += ARR_BLOCK) {
+      int kend = (kk + ARR_BLOCK < p) ? kk + ARR_BLOCK : p;
+      for (int jj = 0; jj < m; jj += ARR_BLOCK) {
+	int jlen = (jj + ARR_BLOCK < m) ? ARR_BLOCK : m - jj;
+	for (int i = ii; i < iend; i++) {
+	  for (int k = kk; k < kend; k++) {
+	    arr_faxpy(a[i * p + k], &b[k * m + jj], &c[i * m + jj], jlen);
+	  }
+	}
+      }
+    }
+  }
+}
+
+/* The elements of "v" as floats: its own for a float array, otherwise */
+/* converted into a new buffer that the caller frees with arr_fdone */
+static double* arr_fget(lval* v) {
+  if (v->elem == LVAL_FLT) { return v->fdata; }
+  int n = v->rows * v->cols;
+  double* d = malloc(sizeof(double) * n);
+  for (int i = 0; i < n; i++) { d[i] = (double) v->data[i]; }
+  return d;
+}
+
+static void arr_fdone(lval* v, double* d) {
+  if (v->elem != LVAL_FLT) { free(d); }
+}
+
+/* Turn an unshared Number array into a float array in place */
+static void arr_to_flt(lval* v) {
+  if (v->elem == LVAL_FLT) { return; }
+  long before = arr_bytes(v);
+  double* d = arr_fget(v);
+  free(v->data);
+  v->fdata = d;
+  v->elem = LVAL_FLT;
+  lbudget_charge(arr_bytes(v) - before);
+}
+
+/* Largest magnitude among n elements, which for LONG_MIN is past LONG_MAX */
+static unsigned long arr_maxabs(const long* x, int n) {
+  unsigned long m = 0;
+  for (int i = 0; i < n; i++) {
+    unsigned long v = (x[i] < 0) ? -(unsigned long) x[i] : (unsigned long) x[i];
+    if (v > m) { m = v; }
+  }
+  return m;
+}
+
+/* Whether "k" products of numbers at most "mx" and "my" in magnitude, */
+/* plus "add", can be summed in a long without overflow at any step, */
+/* in which case the vector kernels give exact results */
+static int arr_fits(unsigned long mx, unsigned long my, long k, unsigned long add) {
+  unsigned long t;
+  return !__builtin_mul_overflow(mx, my, &t)
+    && !__builtin_mul_overflow(t, (unsigned long) k, &t)
+    && !__builtin_add_overflow(t, add, &t)
+    && t <= (unsigned long) LONG_MAX;
+}
+
+/* Sum of x[i * xs] * y[i * ys] over n elements, as a Number while it */
+/* fits and promoted to a big number from the step that overflows, as */
+/* the arithmetic builtins do */
+static lval* arr_dot_exact(const long* x, int xs, const long* y, int ys, int n) {
+  long sum = 0;
+  lval* big = NULL;
+  for (int i = 0; i < n; i++) {
+    long p, t;
+    if (!big && !__builtin_mul_overflow(x[i * xs], y[i * ys], &p)
+	&& !__builtin_add_overflow(sum, p, &t)) {
+      sum = t;
+      continue;
+    }
+    if (!big) { big = lval_num(sum); }
+    lval* b = lval_num(y[i * ys]);
+    lval* prod = lval_big_op(lval_num(x[i * xs]), b, "*");
+    big = lval_big_op(big, prod, "+");
+    lval_del(b);
+    lval_del(prod);
+  }
+  return big ? big : lval_num(sum);
+}
+
+/* dst (cols x rows) = transpose of src (rows x cols), tile by tile, for */
+/* elements of "size" bytes */
+static void arr_transpose(const char* src, char* dst, size_t size,
+			  int rows, int cols) {
+  for (int ii = 0; ii < rows; ii += ARR_BLOCK) {
+    int iend = (ii + ARR_BLOCK < rows) ? ii + ARR_BLOCK : rows;
+    for (int jj = 0; jj < cols; jj += ARR_BLOCK) {
+      int jend = (jj + ARR_BLOCK < cols) ? jj + ARR_BLOCK : cols;
+      for (int i = ii; i < iend; i++) {
+	for (int j = jj; j < jend; j++) {
+	  memcpy(dst + ((size_t) j * rows + i) * size,
+		 src + ((size_t) i * cols + j) * size, size);
+	}
+      }
+    }
+  }
+}
+
+lval* builtin_array(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("array", a, 1);
+  LASSERT_TYPE("array", a, 0, LVAL_QEXPR);
+  LASSERT_NOT_EMPTY("array", a, 0);
+
+  lval* q = a->cell[0];
+
+  /* A flat list of numbers is a single row, otherwise a list of rows. */
+  /* Any float element makes an array of floats. */
+  int flat = (q->cell[0]->type != LVAL_QEXPR);
+  int elem = LVAL_NUM;
+  int rows = flat ? 1 : q->count;
+  int cols = flat ? q->count : q->cell[0]->count;
+
+  for (int i = 0; i < rows; i++) {
+    lval* row = flat ? q : q->cell[i];
+    LASSERT(a, row->type == LVAL_QEXPR,
+	    "Function 'array' passed a row that is not a list. "
+	    "Got %s, Expected %s.",
+	    ltype_name(row->type), ltype_name(LVAL_QEXPR));
+    LASSERT(a, row->count == cols,
+	    "Function 'array' passed rows of different length. "
+	    "Got %i, Expected %i.", row->count, cols);
+    for (int j = 0; j < cols; j++) {
+      int t = row->cell[j]->type;
+      LASSERT(a, t == LVAL_NUM || t == LVAL_FLT,
+	      "Function 'array' passed a non-number element. "
+	      "Got %s, Expected %s.",
+	      ltype_name(t), ltype_name(LVAL_NUM));
+      if (t == LVAL_FLT) { elem = LVAL_FLT; }
+    }
+  }
+  LASSERT(a, cols != 0, "Function 'array' passed an empty row.");
+
+  /* Pack the elements */
+  lval* x = (elem == LVAL_FLT) ? lval_farr(rows, cols) : lval_arr(rows, cols);
+  for (int i = 0; i < rows; i++) {
+    lval* row = flat ? q : q->cell[i];
+    for (int j = 0; j < cols; j++) {
+      if (elem == LVAL_FLT) { x->fdata[i * cols + j] = lval_to_double(row->cell[j]); }
+      else { x->data[i * cols + j] = row->cell[j]->num; }
+    }
+  }
+
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_shape(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("shape", a, 1);
+  LASSERT_TYPE("shape", a, 0, LVAL_ARR);
+
+  lval* x = lval_qexpr();
+  x = lval_add(x, lval_num(a->cell[0]->rows));
+  x = lval_add(x, lval_num(a->cell[0]->cols));
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_dot(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("dot", a, 2);
+  LASSERT_TYPE("dot", a, 0, LVAL_ARR);
+  LASSERT_TYPE("dot", a, 1, LVAL_ARR);
+
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  LASSERT(a, x->rows == y->rows && x->cols == y->cols,
+	  "Function 'dot' passed arrays of different shape. "
+	  "Got %ix%i and %ix%i.", x->rows, x->cols, y->rows, y->cols);
+
+  /* Arrays of floats, or one of each, give a float */
+  int n = x->rows * x->cols;
+  if (x->elem == LVAL_FLT || y->elem == LVAL_FLT) {
+    double* xd = arr_fget(x);
+    double* yd = arr_fget(y);
+    lval* r = lval_flt(arr_fdot(xd, yd, n));
+    arr_fdone(x, xd);
+    arr_fdone(y, yd);
+    lval_del(a);
+    return r;
+  }
+
+  /* Sums that overflow are redone exactly */
+  long sum;
+  lval* r = arr_dot(x->data, y->data, n, &sum)
+    ? arr_dot_exact(x->data, 1, y->data, 1, n) : lval_num(sum);
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_axpy(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("axpy", a, 3);
+  LASSERT(a, a->cell[0]->type == LVAL_NUM || a->cell[0]->type == LVAL_FLT,
+	  "Function 'axpy' passed incorrect type for argument 0. "
+	  "Got %s, Expected %s.",
+	  ltype_name(a->cell[0]->type), ltype_name(LVAL_NUM));
+  LASSERT_TYPE("axpy", a, 1, LVAL_ARR);
+  LASSERT_TYPE("axpy", a, 2, LVAL_ARR);
+
+  lval* x = a->cell[1];
+  lval* y = a->cell[2];
+  LASSERT(a, x->rows == y->rows && x->cols == y->cols,
+	  "Function 'axpy' passed arrays of different shape. "
+	  "Got %ix%i and %ix%i.", x->rows, x->cols, y->rows, y->cols);
+
+  /* Accumulate into y in place and return it, as floats if any of the */
+  /* arguments is */
+  int n = y->rows * y->cols;
+  if (a->cell[0]->type == LVAL_FLT || x->elem == LVAL_FLT || y->elem == LVAL_FLT) {
+    double alpha = lval_to_double(a->cell[0]);
+    y = lval_pop(a, 2);
+    arr_to_flt(y);
+    double* xd = arr_fget(x);
+    arr_faxpy(alpha, xd, y->fdata, n);
+    arr_fdone(x, xd);
+    lval_del(a);
+    return y;
+  }
+
+  /* Elements are longs, so a result that does not fit is an error rather */
+  /* than a big number */
+  long alpha = a->cell[0]->num;
+  y = lval_pop(a, 2);
+  int bad = arr_axpy_checked(alpha, x->data, y->data, n);
+  if (bad >= 0) { lval_del(y); }
+  LASSERT(a, bad < 0, "Function 'axpy' overflowed element %i.", bad);
+  lval_del(a);
+  return y;
+}
+
+lval* builtin_matmul(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("matmul", a, 2);
+  LASSERT_TYPE("matmul", a, 0, LVAL_ARR);
+  LASSERT_TYPE("matmul", a, 1, LVAL_ARR);
+
+  lval* x = a->cell[0];
+  lval* y = a->cell[1];
+  LASSERT(a, x->cols == y->rows,
+	  "Function 'matmul' passed arrays of incompatible shape. "
+	  "Got %ix%i and %ix%i.", x->rows, x->cols, y->rows, y->cols);
+
+  /* The blocked kernel is exact when no sum can overflow. Otherwise each */
+  /* element is summed exactly, and must fit in a long. */
+  int n = x->rows, p = x->cols, m = y->cols;
+  LASSERT(a, (long) n * m <= INT_MAX,
+	  "Function 'matmul' would give %li elements, Expected at most %i.",
+	  (long) n * m, INT_MAX);
+  lval* err = lbudget_reserve((double) n * m * sizeof(double));
+  if (err) {
+    lval_del(a);
+    return err;
+  }
+  if (x->elem == LVAL_FLT || y->elem == LVAL_FLT) {
+    double* xd = arr_fget(x);
+    double* yd = arr_fget(y);
+    lval* r = lval_farr(n, m);
+    arr_fmatmul(xd, yd, r->fdata, n, p, m);
+    arr_fdone(x, xd);
+    arr_fdone(y, yd);
+    lval_del(a);
+    return r;
+  }
+  lval* r = lval_arr(n, m);
+  if (arr_fits(arr_maxabs(x->data, n * p), arr_maxabs(y->data, p * m), p, 0)) {
+    arr_matmul(x->data, y->data, r->data, n, p, m);
+    lval_del(a);
+    return r;
+  }
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < m; j++) {
+      lval* c = arr_dot_exact(&x->data[i * p], 1, &y->data[j], m, p);
+      int fits = (c->type == LVAL_NUM);
+      if (fits) { r->data[i * m + j] = c->num; }
+      lval_del(c);
+      if (!fits) { lval_del(r); }
+      LASSERT(a, fits, "Function 'matmul' overflowed at row %i, column %i.", i, j);
+    }
+  }
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_transpose(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("transpose", a, 1);
+  LASSERT_TYPE("transpose", a, 0, LVAL_ARR);
+
+  lval* x = a->cell[0];
+  lval* r = (x->elem == LVAL_FLT)
+    ? lval_farr(x->cols, x->rows) : lval_arr(x->cols, x->rows);
+  arr_transpose(arr_elems(x), arr_elems(r), arr_size(x), x->rows, x->cols);
+  lval_del(a);
+  return r;
+}
+
+/**************************************************************************/
+/******************** MAP BUILTINS ****************************************/
+/**************************************************************************/
+
+/* Map keys are numbers, or symbols written as a one element Q-expression */
+/* such as {name} since a bare symbol would be looked up. Returns the key */
+/* atom, or NULL if argument "i" is not a valid key. */
+lval* lhmap_key(lval* a, int i) {
+  lval* k = a->cell[i];
+  if (k->type == LVAL_QEXPR && k->count == 1) { k = k->cell[0]; }
+  return (k->type == LVAL_NUM || k->type == LVAL_SYM) ? k : NULL;
+}
+
+int lseq_holds_hmap(lseq* s);
+
+/* Whether a map occurs anywhere inside "v", shared parts included */
+int lval_holds_hmap(lval* v) {
+  int cap = 16;
+  int n = 1;
+  int found = 0;
+  lval** stack = malloc(sizeof(lval*) * cap);
+  stack[0] = v;
+  while (!found && n > 0) {
+    lval* x = stack[--n];
+    found = (x->type == LVAL_HMAP)
+      || (x->type == LVAL_SEQ && lseq_holds_hmap(x->seq));
+    if (LVAL_IS_LIST(x)) { stack = lval_queue_cells(stack, &n, &cap, x); }
+  }
+  free(stack);
+  return found;
+}
+
+#define LASSERT_KEY(func, args, index) \
+  LASSERT(args, lhmap_key(args, index) != NULL, \
+    "Function '%s' passed invalid key for argument %i. " \
+    "Expected a Number or a Symbol in {}.", func, index)
+
+lval* builtin_hmap(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("hmap", a, 1);
+  LASSERT_TYPE("hmap", a, 0, LVAL_QEXPR);
+
+  /* The argument lists alternating keys and values, {} for an empty map */
+  lval* q = a->cell[0];
+  LASSERT(a, q->count % 2 == 0,
+	  "Function 'hmap' passed an odd number of keys and values.");
+  for (int i = 0; i < q->count; i += 2) {
+    LASSERT(a, q->cell[i]->type == LVAL_NUM || q->cell[i]->type == LVAL_SYM,
+	    "Function 'hmap' passed invalid key. "
+	    "Got %s, Expected Number or Symbol.", ltype_name(q->cell[i]->type));
+  }
+
+  lval* x = lval_hmap();
+  q = lval_take(a, 0);
+  while (q->count) {
+    lval* k = lval_pop(q, 0);
+    lhmap_put(x->map, k, lval_pop(q, 0));
+  }
+  lval_del(q);
+  return x;
+}
+
+lval* builtin_hget(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT(a, a->count == 2 || a->count == 3,
+	  "Function 'hget' passed incorrect number of arguments. "
+	  "Got %i, Expected 2 or 3.", a->count);
+  LASSERT_TYPE("hget", a, 0, LVAL_HMAP);
+  LASSERT_KEY("hget", a, 1);
+
+  /* Fall back to the default, if given, for missing keys */
+  lhmap* m = a->cell[0]->map;
+  pthread_mutex_lock(&m->lock);
+  lval* v = lhmap_get(m, lhmap_key(a, 1));
+  if (v) { v = lval_copy(v); }
+  pthread_mutex_unlock(&m->lock);
+  if (!v && a->count == 3) { return lval_take(a, 2); }
+  LASSERT(a, v != NULL, "Function 'hget' passed a key that is not in the map.");
+
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_hput(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("hput", a, 3);
+  LASSERT_TYPE("hput", a, 0, LVAL_HMAP);
+  LASSERT_KEY("hput", a, 1);
+  LASSERT(a, !lval_holds_hmap(a->cell[2]),
+	  "Function 'hput' cannot store a map inside a map.");
+
+  /* Update the shared table in place and return the map */
+  lval* k = lval_copy(lhmap_key(a, 1));
+  lval* v = lval_pop(a, 2);
+  lhmap* m = a->cell[0]->map;
+  pthread_mutex_lock(&m->lock);
+  lhmap_put(m, k, v);
+  pthread_mutex_unlock(&m->lock);
+  return lval_take(a, 0);
+}
+
+lval* builtin_hdel(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("hdel", a, 2);
+  LASSERT_TYPE("hdel", a, 0, LVAL_HMAP);
+  LASSERT_KEY("hdel", a, 1);
+
+  lhmap* m = a->cell[0]->map;
+  pthread_mutex_lock(&m->lock);
+  lhmap_del(m, lhmap_key(a, 1));
+  pthread_mutex_unlock(&m->lock);
+  return lval_take(a, 0);
+}
+
+lval* builtin_hkeys(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("hkeys", a, 1);
+  LASSERT_TYPE("hkeys", a, 0, LVAL_HMAP);
+
+  lhmap* m = a->cell[0]->map;
+  lval* x = lval_qexpr();
+  pthread_mutex_lock(&m->lock);
+  for (int i = 0; i < m->cap; i++) {
+    if (m->slots[i].key) { x = lval_add(x, lval_copy(m->slots[i].key)); }
+  }
+  pthread_mutex_unlock(&m->lock);
+  lval_del(a);
+  return x;
+}
+
+lval* builtin_hlen(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("hlen", a, 1);
+  LASSERT_TYPE("hlen", a, 0, LVAL_HMAP);
+
+  lhmap* m = a->cell[0]->map;
+  pthread_mutex_lock(&m->lock);
+  lval* x = lval_num(m->count);
+  pthread_mutex_unlock(&m->lock);
+  lval_del(a);
+  return x;
+}
+
+/**************************************************************************/
+/******************** SORTING *********************************************/
+/**************************************************************************/
+
+/* Lists of at least this many elements are merge sorted across threads */
+#define SORT_PARALLEL_THRESHOLD 16384
+
+/* Runs of at most this many elements are insertion sorted */
+#define SORT_INSERTION_THRESHOLD 24
+
+/* An element to sort: the value and the key it is ordered by, with the */
+/* key also packed into an unsigned integer for the radix sort */
+typedef struct {
+  lval* key;
+  lval* val;
+  unsigned long bits;
+} lsort_item;
+
+/* Whether "v" can be ordered: any number or a symbol */
+int lval_sortable(lval* v) {
+  return v->type == LVAL_NUM || v->type == LVAL_BIG
+    || v->type == LVAL_FLT || v->type == LVAL_SYM;
+}
+
+/* Total order on sortable values: numbers by value, then symbols */
+/* alphabetically */
+int lval_cmp(lval* x, lval* y) {
+  if (x == y) { return 0; }
+
+  int xs = (x->type == LVAL_SYM), ys = (y->type == LVAL_SYM);
+  if (xs || ys) { return (xs && ys) ? strcmp(x->sym, y->sym) : xs - ys; }
+
+  if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+    return (x->num > y->num) - (x->num < y->num);
+  }
+  if (x->type == LVAL_FLT || y->type == LVAL_FLT) {
+    double a = lval_to_double(x), b = lval_to_double(y);
+    return (a > b) - (a < b);
+  }
+  uint32_t xt[2], yt[2];
+  return lbig_cmp(lval_as_big(x, xt), lval_as_big(y, yt));
+}
+
+/* Stable LSD radix sort on the "bits" of the items, a byte per pass. */
+/* Passes where every item has the same byte are skipped. */
+static void lsort_radix(lsort_item* a, lsort_item* tmp, int n) {
+  for (int shift = 0; shift < 64; shift += 8) {
+    int count[257] = {0};
+    for (int i = 0; i < n; i++) { count[((a[i].bits >> shift) & 0xFF) + 1]++; }
+    if (count[((a[0].bits >> shift) & 0xFF) + 1] == n) { continue; }
+    for (int b = 0; b < 256; b++) { count[b+1] += count[b]; }
+    for (int i = 0; i < n; i++) { tmp[count[(a[i].bits >> shift) & 0xFF]++] = a[i]; }
+    memcpy(a, tmp, sizeof(lsort_item) * n);
+  }
+}
+
+/* Merge the sorted runs a[0 .. m) and a[m .. n) into "out" */
+static void lsort_merge(lsort_item* a, int m, int n, lsort_item* out) {
+  int i = 0, j = m, k = 0;
+  while (i < m && j < n) {
+    out[k++] = (lval_cmp(a[j].key, a[i].key) < 0) ? a[j++] : a[i++];
+  }
+  while (i < m) { out[k++] = a[i++]; }
+  while (j < n) { out[k++] = a[j++]; }
+}
+
+/* Stable merge sort of a[0 .. n) using "tmp" as scratch space */
+static void lsort_merge_sort(lsort_item* a, lsort_item* tmp, int n) {
+  if (n <= SORT_INSERTION_THRESHOLD) {
+    for (int i = 1; i < n; i++) {
+      lsort_item x = a[i];
+      int j = i;
+      while (j > 0 && lval_cmp(x.key, a[j-1].key) < 0) { a[j] = a[j-1]; j--; }
+      a[j] = x;
+    }
+    return;
+  }
+  int m = n / 2;
+  lsort_merge_sort(a, tmp, m);
+  lsort_merge_sort(a + m, tmp + m, n - m);
+  lsort_merge(a, m, n, tmp);
+  memcpy(a, tmp, sizeof(lsort_item) * n);
+}
+
+/* Merge sort in the worker pool, defined with the parallel builtins */
+void lsort_parallel(lsort_item* a, lsort_item* tmp, int n);
+
+/* Sort the items by key, picking the fastest method for the keys */
+void lsort_items(lsort_item* a, int n) {
+  if (n < 2) { return; }
+  lsort_item* tmp = malloc(sizeof(lsort_item) * n);
+
+  /* Plain longs are radix sorted on their bits with the sign flipped */
+  int ints = 1;
+  for (int i = 0; i < n && ints; i++) { ints = (a[i].key->type == LVAL_NUM); }
+
+  if (ints) {
+    for (int i = 0; i < n; i++) {
+      a[i].bits = (unsigned long) a[i].key->num ^ (1UL << 63);
+    }
+    lsort_radix(a, tmp, n);
+  } else {
+    lsort_parallel(a, tmp, n);
+  }
+
+  free(tmp);
+}
+
+/* Keys may be given as a one element Q-expression, as returned by "head" */
+static lval* lsort_key(lval* k) {
+  return (k->type == LVAL_QEXPR && k->count == 1) ? k->cell[0] : k;
+}
+
+lval* builtin_sort(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("sort", a, 1);
+  LASSERT_TYPE("sort", a, 0, LVAL_QEXPR);
+  for (int i = 0; i < a->cell[0]->count; i++) {
+    LASSERT(a, lval_sortable(a->cell[0]->cell[i]),
+	    "Function 'sort' cannot order element %i. "
+	    "Got %s, Expected Number or Symbol.",
+	    i, ltype_name(a->cell[0]->cell[i]->type));
+  }
+
+  /* Reorder the cells of the list in place */
+  lval* q = lval_take(a, 0);
+  lsort_item* items = malloc(sizeof(lsort_item) * (q->count + 1));
+  for (int i = 0; i < q->count; i++) {
+    items[i].key = items[i].val = q->cell[i];
+  }
+  lsort_items(items, q->count);
+  for (int i = 0; i < q->count; i++) { q->cell[i] = items[i].val; }
+
+  free(items);
+  return q;
+}
+
+lval* builtin_sort_by(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("sort-by", a, 2);
+  LASSERT_TYPE("sort-by", a, 0, LVAL_FUN);
+  LASSERT_TYPE("sort-by", a, 1, LVAL_QEXPR);
+
+  lval* f = lval_pop(a, 0);
+  lval* q = lval_take(a, 0);
+  lsort_item* items = malloc(sizeof(lsort_item) * (q->count + 1));
+
+  /* Compute every key once */
+  for (int i = 0; i < q->count; i++) {
+    lval* args = lval_add(lval_sexpr(), lval_copy(q->cell[i]));
+    lval* k = lval_call(e, f, args);
+    items[i].val = q->cell[i];
+    items[i].key = k;
+
+    if (k->type == LVAL_ERR || !lval_sortable(lsort_key(k))) {
+      lval* err = (k->type == LVAL_ERR) ? lval_copy(k)
+	: lval_err("Function 'sort-by' got a key it cannot order. "
+		   "Got %s, Expected Number or Symbol.",
+		   ltype_name(lsort_key(k)->type));
+      for (int j = 0; j <= i; j++) { lval_del(items[j].key); }
+      free(items);
+      lval_del(f);
+      lval_del(q);
+      return err;
+    }
+  }
+
+  /* Sort by the unwrapped keys, keeping the wrappers to free them later */
+  lval** keys = malloc(sizeof(lval*) * (q->count + 1));
+  for (int i = 0; i < q->count; i++) {
+    keys[i] = items[i].key;
+    items[i].key = lsort_key(items[i].key);
+  }
+  lsort_items(items, q->count);
+  for (int i = 0; i < q->count; i++) {
+    q->cell[i] = items[i].val;
+    lval_del(keys[i]);
+  }
+
+  free(keys);
+  free(items);
+  lval_del(f);
+  return q;
+}
+
+lval* builtin_bsearch(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("bsearch", a, 2);
+  LASSERT(a, lval_sortable(lsort_key(a->cell[0])),
+	  "Function 'bsearch' cannot order argument 0. "
+	  "Got %s, Expected Number or Symbol.",
+	  ltype_name(lsort_key(a->cell[0])->type));
+  LASSERT_TYPE("bsearch", a, 1, LVAL_QEXPR);
+
+  /* Find the first position not less than the value in the sorted list. */
+  /* Symbols are looked for as {name}, like map keys. */
+  lval* x = lsort_key(a->cell[0]);
+  lval* q = a->cell[1];
+  int lo = 0, hi = q->count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    LASSERT(a, lval_sortable(q->cell[mid]),
+	    "Function 'bsearch' cannot order element %i. "
+	    "Got %s, Expected Number or Symbol.",
+	    mid, ltype_name(q->cell[mid]->type));
+    if (lval_cmp(q->cell[mid], x) < 0) { lo = mid + 1; } else { hi = mid; }
+  }
+
+  /* Return its index if it is there, otherwise -1 */
+  int found = (lo < q->count && lval_cmp(q->cell[lo], x) == 0);
+  lval_del(a);
+  return lval_num(found ? lo : -1);
+}
+
+lval* builtin_unique(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("unique", a, 1);
+  LASSERT_TYPE("unique", a, 0, LVAL_QEXPR);
+
+  /* Keep the first of equal elements, found through a set of the kept */
+  /* ones keyed by structural hash */
+  lval* q = lval_take(a, 0);
+  int cap = 16;
+  while (cap < q->count * 2) { cap *= 2; }
+  lval** set = calloc(cap, sizeof(lval*));
+
+  int kept = 0;
+  for (int i = 0; i < q->count; i++) {
+    lval* x = q->cell[i];
+    unsigned long h = lval_hash(x);
+    int j = h & (cap - 1);
+    while (set[j] && !lval_eq(set[j], x)) { j = (j + 1) & (cap - 1); }
+    if (set[j]) {
+      lval_del(x);
+    } else {
+      set[j] = x;
+      q->cell[kept++] = x;
+    }
+  }
+  q->count = kept;
+
+  free(set);
+  return q;
+}
+
+/**************************************************************************/
+/******************** HIGHER-ORDER FUNCTIONS ******************************/
+/**************************************************************************/
+
+/* Results count as false when they are 0, {} or (), and true otherwise */
+int lval_truthy(lval* v) {
+  if (v->type == LVAL_NUM) { return v->num != 0; }
+  if (v->type == LVAL_FLT) { return v->flt != 0; }
+  if (LVAL_IS_LIST(v)) { return v->count != 0; }
+  return 1;
+}
+
+/* Call "f" with the single argument "x", taking ownership of "x" */
+lval* lval_call1(lenv* e, lval* f, lval* x) {
+  return lval_call(e, f, lval_add(lval_sexpr(), x));
+}
+
+/* Call "f" with the arguments "x" and "y", taking ownership of both */
+lval* lval_call2(lenv* e, lval* f, lval* x, lval* y) {
+  return lval_call(e, f, lval_add(lval_add(lval_sexpr(), x), y));
+}
+
+/* Arithmetic builtins are already a left fold over their arguments, so */
+/* folding with one of them is a single call on the whole list */
+static char* lfold_op(lval* f) {
+  if (f->memo) { return NULL; }
+  if (f->fun == builtin_add) { return "+"; }
+  if (f->fun == builtin_sub) { return "-"; }
+  if (f->fun == builtin_mul) { return "*"; }
+  if (f->fun == builtin_div) { return "/"; }
+  if (f->fun == builtin_mod) { return "%"; }
+  if (f->fun == builtin_pow) { return "^"; }
+  if (f->fun == builtin_min) { return "min"; }
+  if (f->fun == builtin_max) { return "max"; }
+  return NULL;
+}
+
+/* Elements handed to an arithmetic builtin in one call when folding a */
+/* stream of them */
+#define LFOLD_CHUNK 256
+
+/* Apply the arithmetic builtin "op" to "acc" and the "n" elements "xs", */
+/* taking ownership of all of them */
+lval* lval_fold_chunk(lenv* e, char* op, lval* acc, lval** xs, int n) {
+  if (n == 0) { return acc; }
+  lval* args = lval_sexpr();
+  args->cell = malloc(sizeof(lval*) * (n + 1));
+  args->cell[args->count++] = acc;
+  for (int i = 0; i < n; i++) { args->cell[args->count++] = xs[i]; }
+  return builtin_op(e, args, op);
+}
+
+lval* builtin_map(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("map", a, 2);
+  LASSERT_TYPE("map", a, 0, LVAL_FUN);
+  LASSERT_LIST("map", a, 1);
+
+  lval* f = lval_pop(a, 0);
+  lval* q = lval_take(a, 0);
+  int range = (q->type == LVAL_RANGE);
+
+  /* Results go straight into a list of the final size */
+  lval* r = lval_qexpr();
+  r->cell = malloc(sizeof(lval*) * q->count);
+  for (int i = 0; i < q->count; i++) {
+    lval* y = lval_call1(e, f, range ? lval_num(lrange_at(q, i)) : q->cell[i]);
+    if (y->type == LVAL_ERR) {
+      for (int j = i + 1; j < q->count && !range; j++) { lval_del(q->cell[j]); }
+      q->count = 0;
+      lval_del(q);
+      lval_del(r);
+      lval_del(f);
+      return y;
+    }
+    r->cell[r->count++] = y;
+  }
+
+  q->count = 0;
+  lval_del(q);
+  lval_del(f);
+  return r;
+}
+
+lval* builtin_filter(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("filter", a, 2);
+  LASSERT_TYPE("filter", a, 0, LVAL_FUN);
+  LASSERT_LIST("filter", a, 1);
+
+  lval* f = lval_pop(a, 0);
+  lval* q = lval_take(a, 0);
+
+  /* Compact the kept elements to the front of the list in place, or */
+  /* collect the kept numbers of a range into a new list */
+  int range = (q->type == LVAL_RANGE);
+  lval* r = q;
+  if (range) {
+    r = lval_qexpr();
+    r->cell = malloc(sizeof(lval*) * q->count);
+  }
+
+  int kept = 0;
+  for (int i = 0; i < q->count; i++) {
+    lval* x = range ? lval_num(lrange_at(q, i)) : q->cell[i];
+    lval* t = lval_call1(e, f, lval_copy(x));
+    if (t->type == LVAL_ERR) {
+      lval_del(x);
+      for (int j = i + 1; j < q->count && !range; j++) { lval_del(q->cell[j]); }
+      r->count = kept;
+      lval_del(r);
+      if (range) { lval_del(q); }
+      lval_del(f);
+      return t;
+    }
+    if (lval_truthy(t)) {
+      r->cell[kept++] = x;
+    } else {
+      lval_del(x);
+    }
+    lval_del(t);
+  }
+  r->count = kept;
+
+  if (range) { lval_del(q); }
+  lval_del(f);
+  return r;
+}
+
+/* Fold "f" over the elements of "q" starting from "acc", consuming all */
+lval* lval_fold(lenv* e, lval* f, lval* acc, lval* q) {
+
+  /* Nothing to fold leaves "acc" as it is, rather than negating it */
+  if (q->count == 0) {
+    lval_del(q);
+    return acc;
+  }
+
+  /* One call does the whole fold for arithmetic builtins */
+  char* op = lfold_op(f);
+  if (op) {
+    lval* args = lval_sexpr();
+    args->cell = malloc(sizeof(lval*) * (q->count + 1));
+    args->cell[args->count++] = acc;
+    for (int i = 0; i < q->count; i++) { args->cell[args->count++] = q->cell[i]; }
+    q->count = 0;
+    lval_del(q);
+    return builtin_op(e, args, op);
+  }
+
+  for (int i = 0; i < q->count; i++) {
+    acc = lval_call2(e, f, acc, q->cell[i]);
+    q->cell[i] = NULL;
+    if (acc->type == LVAL_ERR) {
+      for (int j = i + 1; j < q->count; j++) { lval_del(q->cell[j]); }
+      break;
+    }
+  }
+  q->count = 0;
+  lval_del(q);
+  return acc;
+}
+
+lval* builtin_fold(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("fold", a, 3);
+  LASSERT_TYPE("fold", a, 0, LVAL_FUN);
+  LASSERT_SEQ("fold", a, 2);
+
+  /* Sequences and ranges are folded as they are read */
+  if (a->cell[2]->type != LVAL_QEXPR) {
+    if (a->cell[2]->type == LVAL_SEQ) { LASSERT_FINITE("fold", a, 2); }
+    lval* acc = lval_pop(a, 1);
+    lseq* s = lseq_of(lval_pop(a, 1));
+    lval* x = lseq_fold(e, a->cell[0], acc, s);
+    lseq_release(s);
+    lval_del(a);
+    return x;
+  }
+
+  lval* f = lval_pop(a, 0);
+  lval* acc = lval_pop(a, 0);
+  lval* x = lval_fold(e, f, acc, lval_take(a, 0));
+  lval_del(f);
+  return x;
+}
+
+lval* builtin_reduce(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("reduce", a, 2);
+  LASSERT_TYPE("reduce", a, 0, LVAL_FUN);
+  LASSERT_SEQ("reduce", a, 1);
+
+  /* Sequences and ranges are folded as they are read */
+  if (a->cell[1]->type != LVAL_QEXPR) {
+    if (a->cell[1]->type == LVAL_SEQ) { LASSERT_FINITE("reduce", a, 1); }
+    lseq* s = lseq_of(lval_pop(a, 1));
+    lval* x = lseq_fold(e, a->cell[0], NULL, s);
+    lseq_release(s);
+    LASSERT(a, x != NULL, "Function '%s' passed {} for argument %i.", "reduce", 1);
+    lval_del(a);
+    return x;
+  }
+  LASSERT_NOT_EMPTY("reduce", a, 1);
+
+  /* Fold the rest of the list starting from its first element */
+  lval* f = lval_pop(a, 0);
+  lval* q = lval_take(a, 0);
+  lval* acc = lval_pop(q, 0);
+  lval* x = lval_fold(e, f, acc, q);
+  lval_del(f);
+  return x;
+}
+
+/**************************************************************************/
+/******************** LAZY SEQUENCES **************************************/
+/**************************************************************************/
+
+/* Produce element "i" of a source, or NULL past its end. Sources are read */
+/* in order from 0, and "state" belongs to the reader, starting as NULL. */
+typedef lval* (*lseq_gen)(lenv* e, lseq* s, long i, lval** state);
+
+enum { LSEQ_SOURCE, LSEQ_MAP, LSEQ_FILTER, LSEQ_TAKE, LSEQ_DROP };
+
+/* An immutable description of a sequence: either a source of elements or */
+/* a step applied to the elements of another sequence. Nothing is computed */
+/* until the sequence is read, and each read starts again from the source. */
+struct lseq {
+  int refs;
+  int op;
+  lseq* from;
+  lseq_gen gen;
+  lval* f;
+  lval* x;
+  long n;
+  int finite;
+};
+
+/* A new source reading "x" with the help of "f", taking over both */
+lseq* lseq_source(lseq_gen gen, lval* f, lval* x, int finite) {
+  lseq* s = malloc(sizeof(lseq));
+  s->refs = 1;
+  s->op = LSEQ_SOURCE;
+  s->from = NULL;
+  s->gen = gen;
+  s->f = f;
+  s->x = x ? lval_intern(x) : NULL;
+  s->n = 0;
+  s->finite = finite;
+  return s;
+}
+
+/* A new step over the elements of "from", taking over "from" and "f" */
+lseq* lseq_step(int op, lseq* from, lval* f, long n) {
+  lseq* s = malloc(sizeof(lseq));
+  s->refs = 1;
+  s->op = op;
+  s->from = from;
+  s->gen = NULL;
+  s->f = f;
+  s->x = NULL;
+  s->n = n;
+  s->finite = (op == LSEQ_TAKE) || from->finite;
+  return s;
+}
+
+/* Whether reading "s" comes to an end without an error */
+int lseq_finite(lseq* s) {
+  return s->finite;
+}
+
+/* Take another reference to a sequence */
+lseq* lseq_share(lseq* s) {
+  LREF_INC(s->refs);
+  return s;
+}
+
+void lseq_release(lseq* s) {
+  while (s && LREF_DEC(s->refs) == 0) {
+    lseq* from = s->from;
+    if (s->f) { lval_del(s->f); }
+    if (s->x) { lval_del(s->x); }
+    free(s);
+    s = from;
+  }
+}
+
+/* Whether a map occurs in any value the sequence holds */
+int lseq_holds_hmap(lseq* s) {
+  for (; s; s = s->from) {
+    if (s->x && lval_holds_hmap(s->x)) { return 1; }
+  }
+  return 0;
+}
+
+/* The elements of a list */
+static lval* lseq_gen_list(lenv* e, lseq* s, long i, lval** state) {
+  return (i < s->x->count) ? lval_copy(s->x->cell[i]) : NULL;
+}
+
+/* The same value forever */
+static lval* lseq_gen_repeat(lenv* e, lseq* s, long i, lval** state) {
+  return lval_copy(s->x);
+}
+
+/* A value, then "f" of it, then "f" of that, and so on */
+static lval* lseq_gen_iterate(lenv* e, lseq* s, long i, lval** state) {
+  *state = (i == 0) ? lval_copy(s->x) : lval_call1(e, s->f, *state);
+  return lval_copy(*state);
+}
+
+/* "f" of 0, 1, 2 and so on */
+static lval* lseq_gen_generate(lenv* e, lseq* s, long i, lval** state) {
+  return lval_call1(e, s->f, lval_num(i));
+}
+
+/* The numbers of a range */
+static lval* lseq_gen_range(lenv* e, lseq* s, long i, lval** state) {
+  return (i < s->x->count) ? lval_num(lrange_at(s->x, i)) : NULL;
+}
+
+/* The sequence for a sequence, list or range argument, taking ownership */
+/* of "v" */
+lseq* lseq_of(lval* v) {
+  if (v->type == LVAL_SEQ) {
+    lseq* s = lseq_share(v->seq);
+    lval_del(v);
+    return s;
+  }
+  if (v->type == LVAL_RANGE) { return lseq_source(lseq_gen_range, NULL, v, 1); }
+  return lseq_source(lseq_gen_list, NULL, v, 1);
+}
+
+/* Position of one pass over a sequence */
+typedef struct {
+  lseq* src;
+  lseq** steps;
+  long* left;
+  int nsteps;
+  long i;
+  lval* state;
+  int done;
+} lseq_reader;
+
+void lseq_open(lseq_reader* r, lseq* s) {
+  int n = 0;
+  for (lseq* t = s; t->from; t = t->from) { n++; }
+
+  /* Steps are applied innermost first */
+  r->steps = malloc(sizeof(lseq*) * n);
+  r->left = malloc(sizeof(long) * n);
+  r->nsteps = n;
+  r->i = 0;
+  r->state = NULL;
+  r->done = 0;
+  for (int k = n-1; k >= 0; k--, s = s->from) {
+    r->steps[k] = s;
+    r->left[k] = s->n;
+    if (s->op == LSEQ_TAKE && s->n == 0) { r->done = 1; }
+  }
+  r->src = s;
+}
+
+void lseq_close(lseq_reader* r) {
+  if (r->state) { lval_del(r->state); }
+  free(r->steps);
+  free(r->left);
+}
+
+/* The next element, NULL at the end, or an error which also ends it */
+
+lval* lseq_next(lenv* e, lseq_reader* r) {
+  while (!r->done) {
+    /* Long sequences stop with the evaluation's budget */
+    if (lbudget_cur) {
+      lval* err = lbudget_check();
+      if (err) { r->done = 1; return err; }
+    }
+
+    lval* x = r->src->gen(e, r->src, r->i++, &r->state);
+    if (!x) { r->done = 1; return NULL; }
+
+    for (int k = 0; k < r->nsteps && x && x->type != LVAL_ERR; k++) {
+      lseq* s = r->steps[k];
+      switch (s->op) {
+        case LSEQ_MAP:
+          x = lval_call1(e, s->f, x);
+          break;
+        case LSEQ_FILTER: {
+          lval* t = lval_call1(e, s->f, lval_copy(x));
+          if (t->type == LVAL_ERR) { lval_del(x); x = t; break; }
+          int keep = lval_truthy(t);
+          lval_del(t);
+          if (!keep) { lval_del(x); x = NULL; }
+          break;
+        }
+        case LSEQ_DROP:
+          if (r->left[k] > 0) { r->left[k]--; lval_del(x); x = NULL; }
+          break;
+        case LSEQ_TAKE:
+          /* Nothing gets past a take once it has let its elements through */
+          if (--r->left[k] == 0) { r->done = 1; }
+          break;
+      }
+    }
+
+    if (x) {
+      if (x->type == LVAL_ERR) { r->done = 1; }
+      return x;
+    }
+  }
+  return NULL;
+}
+
+/* Fold "f" over the elements of "s" starting from "acc", or from the */
+/* first element when "acc" is NULL. Returns NULL for an empty reduce. */
+lval* lseq_fold(lenv* e, lval* f, lval* acc, lseq* s) {
+  lseq_reader r;
+  lseq_open(&r, s);
+
+  /* Arithmetic builtins take the elements a chunk at a time */
+  char* op = lfold_op(f);
+  lval* chunk[LFOLD_CHUNK];
+  int n = 0;
+
+  lval* x;
+  while ((!acc || acc->type != LVAL_ERR) && (x = lseq_next(e, &r))) {
+    if (x->type == LVAL_ERR) {
+      if (acc) { lval_del(acc); }
+      acc = x;
+    } else if (!acc) {
+      acc = x;
+    } else if (op) {
+      chunk[n++] = x;
+      if (n == LFOLD_CHUNK) {
+        acc = lval_fold_chunk(e, op, acc, chunk, n);
+        n = 0;
+      }
+    } else {
+      acc = lval_call2(e, f, acc, x);
+    }
+  }
+
+  if (n > 0 && acc->type == LVAL_ERR) {
+    while (n > 0) { lval_del(chunk[--n]); }
+  }
+  if (n > 0) { acc = lval_fold_chunk(e, op, acc, chunk, n); }
+
+  lseq_close(&r);
+  return acc;
+}
+
+lval* builtin_seq(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("seq", a, 1);
+  LASSERT_TYPE("seq", a, 0, LVAL_QEXPR);
+
+  return lval_seq(lseq_of(lval_take(a, 0)));
+}
+
+lval* builtin_repeat(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("repeat", a, 1);
+
+  return lval_seq(lseq_source(lseq_gen_repeat, NULL, lval_take(a, 0), 0));
+}
+
+lval* builtin_iterate(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("iterate", a, 2);
+  LASSERT_TYPE("iterate", a, 0, LVAL_FUN);
+
+  lval* f = lval_pop(a, 0);
+  return lval_seq(lseq_source(lseq_gen_iterate, f, lval_take(a, 0), 0));
+}
+
+lval* builtin_generate(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("generate", a, 1);
+  LASSERT_TYPE("generate", a, 0, LVAL_FUN);
+
+  return lval_seq(lseq_source(lseq_gen_generate, lval_take(a, 0), NULL, 0));
+}
+
+/* Shared by take and drop: a count and the sequence it applies to */
+lval* builtin_count_step(lenv* e, lval* a, char* func, int op) {
+  /* Check error conditions */
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_NUM);
+  LASSERT(a, a->cell[0]->num >= 0,
+    "Function '%s' passed negative count %li.", func, a->cell[0]->num);
+  LASSERT_SEQ(func, a, 1);
+
+  long n = a->cell[0]->num;
+  lseq* from = lseq_of(lval_take(a, 1));
+  return lval_seq(lseq_step(op, from, NULL, n));
+}
+
+lval* builtin_take(lenv* e, lval* a) {
+  return builtin_count_step(e, a, "take", LSEQ_TAKE);
+}
+
+lval* builtin_drop(lenv* e, lval* a) {
+  return builtin_count_step(e, a, "drop", LSEQ_DROP);
+}
+
+/* Shared by seq-map and seq-filter: a function and the sequence it */
+/* applies to */
+lval* builtin_fun_step(lenv* e, lval* a, char* func, int op) {
+  /* Check error conditions */
+  LASSERT_NUM(func, a, 2);
+  LASSERT_TYPE(func, a, 0, LVAL_FUN);
+  LASSERT_SEQ(func, a, 1);
+
+  lval* f = lval_pop(a, 0);
+  lseq* from = lseq_of(lval_take(a, 0));
+  return lval_seq(lseq_step(op, from, f, 0));
+}
+
+lval* builtin_seq_map(lenv* e, lval* a) {
+  return builtin_fun_step(e, a, "seq-map", LSEQ_MAP);
+}
+
+lval* builtin_seq_filter(lenv* e, lval* a) {
+  return builtin_fun_step(e, a, "seq-filter", LSEQ_FILTER);
+}
+
+lval* builtin_realize(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("realize", a, 1);
+  LASSERT_SEQ("realize", a, 0);
+  if (a->cell[0]->type == LVAL_RANGE) { LASSERT_TYPE("realize", a, 0, LVAL_QEXPR); }
+  if (a->cell[0]->type == LVAL_QEXPR) { return lval_take(a, 0); }
+  LASSERT_FINITE("realize", a, 0);
+
+  lseq_reader r;
+  lseq_open(&r, a->cell[0]->seq);
+  lval* q = lval_qexpr();
+  lval* x;
+  while ((x = lseq_next(e, &r))) {
+    if (x->type == LVAL_ERR) {
+      lval_del(q);
+      q = x;
+      break;
+    }
+    lval_add(q, x);
+  }
+  lseq_close(&r);
+  lval_del(a);
+  return q;
+}
+
+/**************************************************************************/
+/******************** WORKER POOL *****************************************/
+/**************************************************************************/
+
+/* A task is embedded at the start of whatever data its "run" needs. Each */
+/* belongs to a group that its submitter waits on. */
+typedef struct ltask ltask;
+
+typedef struct {
+  int pending;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+} lgroup;
+
+struct ltask {
+  void (*run)(ltask* t);
+  lgroup* group;
+};
+
+/* Double-ended queue of tasks. Its owner pushes and pops at the bottom, */
+/* other threads steal the oldest tasks from the top. */
+typedef struct {
+  pthread_mutex_t lock;
+  ltask** tasks;
+  int cap;
+  long top;
+  long bottom;
+} ldeque;
+
+/* Bounded queue of pointers for any number of producers and consumers. */
+/* Each slot's sequence number tells producers and consumers whether it */
+/* is free or filled for their position, so both ends claim slots with a */
+/* single compare-and-swap and never take a lock. */
+typedef struct {
+  long seq;
+  void* item;
+} lring_slot;
+
+typedef struct {
+  lring_slot* slots;
+  long cap;
+  long head;
+  char pad[64];
+  long tail;
+} lring;
+
+/* Capacity of the pool's queue of independent tasks */
+#define LRING_SIZE 1024
+
+/* One deque per worker, plus one shared by threads outside the pool, and */
+/* the queue of independent tasks */
+typedef struct {
+  int nworkers;
+  ldeque* deques;
+  lring* ring;
+  int queued;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+} lpool;
+
+static lpool lpool_main;
+static pthread_once_t lpool_once = PTHREAD_ONCE_INIT;
+
+/* Deque of the current thread, and how many tasks it is running. Tasks */
+/* must not change the environment that other tasks are reading. */
+static __thread int lpool_self = -1;
+static __thread int ltask_depth = 0;
+
+static void ldeque_push(ldeque* d, ltask* t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->bottom - d->top == d->cap) {
+    ltask** tasks = malloc(sizeof(ltask*) * d->cap * 2);
+    for (long i = d->top; i < d->bottom; i++) {
+      tasks[i % (d->cap * 2)] = d->tasks[i % d->cap];
+    }
+    free(d->tasks);
+    d->tasks = tasks;
+    d->cap *= 2;
+  }
+  d->tasks[d->bottom++ % d->cap] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/* Newest task, for the owner */
+static ltask* ldeque_pop(ldeque* d) {
+  pthread_mutex_lock(&d->lock);
+  ltask* t = (d->bottom > d->top) ? d->tasks[--d->bottom % d->cap] : NULL;
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+/* Newest task, for the owner, if it is one of group "g" */
+static ltask* ldeque_pop_group(ldeque* d, lgroup* g) {
+  pthread_mutex_lock(&d->lock);
+  ltask* t = NULL;
+  if (d->bottom > d->top && d->tasks[(d->bottom - 1) % d->cap]->group == g) {
+    t = d->tasks[--d->bottom % d->cap];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+/* Oldest task, for thieves */
+static ltask* ldeque_steal(ldeque* d) {
+  pthread_mutex_lock(&d->lock);
+  ltask* t = (d->bottom > d->top) ? d->tasks[d->top++ % d->cap] : NULL;
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+/* A queue of "cap" slots. Full and empty slots could not be told apart */
+/* with fewer than two. */
+static void lring_init(lring* r, long cap) {
+  r->cap = (cap < 2) ? 2 : cap;
+  r->slots = malloc(sizeof(lring_slot) * r->cap);
+  for (long i = 0; i < r->cap; i++) { r->slots[i].seq = i; }
+  r->head = 0;
+  r->tail = 0;
+}
+
+/* Add "x" at the tail, or return 0 if the queue is full */
+static int lring_push(lring* r, void* x) {
+  long pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  lring_slot* s;
+  for (;;) {
+    s = &r->slots[pos % r->cap];
+    long d = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - pos;
+    if (d == 0) {
+      if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { break; }
+    } else if (d < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+  }
+  s->item = x;
+  __atomic_store_n(&s->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Take the item at the head, or NULL if the queue is empty */
+static void* lring_pop(lring* r) {
+  long pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  lring_slot* s;
+  for (;;) {
+    s = &r->slots[pos % r->cap];
+    long d = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE) - (pos + 1);
+    if (d == 0) {
+      if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { break; }
+    } else if (d < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+  }
+  void* x = s->item;
+  __atomic_store_n(&s->seq, pos + r->cap, __ATOMIC_RELEASE);
+  return x;
+}
+
+/* Find work for the current thread: its own newest task first, then the */
+/* oldest independent task, otherwise the oldest task of another deque */
+static ltask* lpool_find(lpool* p) {
+  int n = p->nworkers + 1;
+  int self = (lpool_self >= 0) ? lpool_self : p->nworkers;
+  ltask* t = ldeque_pop(&p->deques[self]);
+  if (!t) { t = lring_pop(p->ring); }
+  for (int k = 1; !t && k < n; k++) {
+    t = ldeque_steal(&p->deques[(self + k) % n]);
+  }
+  if (t) { __atomic_sub_fetch(&p->queued, 1, __ATOMIC_ACQ_REL); }
+  return t;
+}
+
+/* Tasks without a group may be freed by "run" itself */
+static void ltask_run(ltask* t) {
+  lgroup* g = t->group;
+  ltask_depth++;
+  t->run(t);
+  ltask_depth--;
+  if (!g) { return; }
+  pthread_mutex_lock(&g->lock);
+  if (__atomic_sub_fetch(&g->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    pthread_cond_broadcast(&g->done);
+  }
+  pthread_mutex_unlock(&g->lock);
+}
+
+static void* lpool_worker(void* arg) {
+  lpool* p = &lpool_main;
+  lpool_self = (int) (long) arg;
+  for (;;) {
+    ltask* t = lpool_find(p);
+    if (t) { ltask_run(t); continue; }
+
+    /* Sleep until a task is queued anywhere */
+    pthread_mutex_lock(&p->lock);
+    while (__atomic_load_n(&p->queued, __ATOMIC_ACQUIRE) == 0) {
+      pthread_cond_wait(&p->wake, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+  return NULL;
+}
+
+/* Start one worker per processor besides the calling thread, which */
+/* works too while it waits */
+static void lpool_start(void) {
+  lpool* p = &lpool_main;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  p->nworkers = (cpus > 1) ? cpus - 1 : 1;
+  p->queued = 0;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->wake, NULL);
+  p->deques = malloc(sizeof(ldeque) * (p->nworkers + 1));
+  for (int i = 0; i <= p->nworkers; i++) {
+    pthread_mutex_init(&p->deques[i].lock, NULL);
+    p->deques[i].cap = 64;
+    p->deques[i].tasks = malloc(sizeof(ltask*) * 64);
+    p->deques[i].top = 0;
+    p->deques[i].bottom = 0;
+  }
+  p->ring = malloc(sizeof(lring));
+  lring_init(p->ring, LRING_SIZE);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (int i = 0; i < p->nworkers; i++) {
+    pthread_t t;
+    pthread_create(&t, &attr, lpool_worker, (void*) (long) i);
+  }
+  pthread_attr_destroy(&attr);
+}
+
+lpool* lpool_get(void) {
+  pthread_once(&lpool_once, lpool_start);
+  return &lpool_main;
+}
+
+/* Start the pool afresh in a child forked while it was idle, which has */
+/* its queues but none of its workers */
+void lpool_after_fork(void) {
+  lpool* p = &lpool_main;
+  if (!p->deques) { return; }
+  for (int i = 0; i <= p->nworkers; i++) { free(p->deques[i].tasks); }
+  free(p->deques);
+  free(p->ring->slots);
+  free(p->ring);
+  lpool_start();
+}
+
+void lgroup_init(lgroup* g) {
+  g->pending = 0;
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->done, NULL);
+}
+
+/* Count a newly queued task and wake a worker for it */
+static void lpool_wake(lpool* p) {
+  __atomic_add_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_signal(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* Queue task "t" as part of group "g" */
+void lpool_submit(lpool* p, lgroup* g, ltask* t) {
+  t->group = g;
+  __atomic_add_fetch(&g->pending, 1, __ATOMIC_ACQ_REL);
+  int self = (lpool_self >= 0) ? lpool_self : p->nworkers;
+  ldeque_push(&p->deques[self], t);
+  lpool_wake(p);
+}
+
+/* Queue the independent task "t", or return 0 if the queue is full */
+int lpool_post(lpool* p, ltask* t) {
+  t->group = NULL;
+  if (!lring_push(p->ring, t)) { return 0; }
+  lpool_wake(p);
+  return 1;
+}
+
+/* Run the queued tasks of "g" until all have finished, then free it. */
+/* Tasks of other groups are left to the workers, as they could be */
+/* waiting for the caller in turn. */
+void lgroup_wait(lpool* p, lgroup* g) {
+  int self = (lpool_self >= 0) ? lpool_self : p->nworkers;
+  while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) > 0) {
+    ltask* t = ldeque_pop_group(&p->deques[self], g);
+    if (t) {
+      __atomic_sub_fetch(&p->queued, 1, __ATOMIC_ACQ_REL);
+      ltask_run(t);
+      continue;
+    }
+
+    /* Nothing left to help with, so wait for the running tasks */
+    pthread_mutex_lock(&g->lock);
+    while (__atomic_load_n(&g->pending, __ATOMIC_ACQUIRE) > 0) {
+      pthread_cond_wait(&g->done, &g->lock);
+    }
+    pthread_mutex_unlock(&g->lock);
+  }
+
+  /* The last task may still be signalling the group under its lock */
+  pthread_mutex_lock(&g->lock);
+  pthread_mutex_unlock(&g->lock);
+  pthread_mutex_destroy(&g->lock);
+  pthread_cond_destroy(&g->done);
+}
+
+/* Whether the current thread is running a pool task */
+int lpool_in_task(void) {
+  return ltask_depth > 0;
+}
+
+/**************************************************************************/
+/******************** PARALLEL BUILTINS ***********************************/
+/**************************************************************************/
+
+/* Part of a list or range handled by one task */
+typedef struct {
+  ltask task;
+  lenv* e;
+  lval* f;
+  lval* q;
+  int from;
+  int to;
+  /* pmap: a result per element; preduce: the slice's reduction */
+  lval** out;
+  lval* acc;
+} lchunk;
+
+/* Left half of a split in a parallel merge sort */
+typedef struct {
+  ltask task;
+  lsort_item* a;
+  lsort_item* tmp;
+  int n;
+  int depth;
+} lsort_job;
+
+static void lsort_split(lsort_item* a, lsort_item* tmp, int n, int depth);
+
+static void lsort_job_run(ltask* t) {
+  lsort_job* j = (lsort_job*) t;
+  lsort_split(j->a, j->tmp, j->n, j->depth);
+}
+
+/* Sort a[0 .. n), queueing the left half of each of up to "depth" */
+/* splits for another worker to steal while this thread sorts the right */
+static void lsort_split(lsort_item* a, lsort_item* tmp, int n, int depth) {
+  if (depth == 0 || n < SORT_PARALLEL_THRESHOLD) {
+    lsort_merge_sort(a, tmp, n);
+    return;
+  }
+
+  lpool* p = lpool_get();
+  int m = n / 2;
+  lsort_job left;
+  left.task.run = lsort_job_run;
+  left.a = a;
+  left.tmp = tmp;
+  left.n = m;
+  left.depth = depth - 1;
+  lgroup g;
+  lgroup_init(&g);
+  lpool_submit(p, &g, &left.task);
+  lsort_split(a + m, tmp + m, n - m, depth - 1);
+  lgroup_wait(p, &g);
+
+  lsort_merge(a, m, n, tmp);
+  memcpy(a, tmp, sizeof(lsort_item) * n);
+}
+
+/* Merge sort a[0 .. n) in the pool, in about as many parts as it has */
+/* threads, so that sorts never start threads of their own */
+void lsort_parallel(lsort_item* a, lsort_item* tmp, int n) {
+  lpool* p = lpool_get();
+  int depth = 0;
+  while ((1 << depth) < p->nworkers + 1) { depth++; }
+  lsort_split(a, tmp, n, depth);
+}
+
+/* Number of tasks a list of "n" elements is split into: a few per */
+/* thread, so that stealing can even out slices of uneven cost */
+static int lchunk_count(lpool* p, int n) {
+  int k = (p->nworkers + 1) * 4;
+  return (n < k) ? n : k;
+}
+
+/* Element "i" of a list or range, moved out of a list */
+static lval* lchunk_elem(lval* q, int i) {
+  return (q->type == LVAL_RANGE) ? lval_num(lrange_at(q, i)) : q->cell[i];
+}
+
+/* Free the elements of a list that a failed slice did not reach */
+static void lchunk_drop(lchunk* c, int i) {
+  if (c->q->type == LVAL_RANGE) { return; }
+  for (; i < c->to; i++) { lval_del(c->q->cell[i]); }
+}
+
+static void lchunk_map(ltask* t) {
+  lchunk* c = (lchunk*) t;
+  for (int i = c->from; i < c->to; i++) {
+    c->out[i] = lval_call1(c->e, c->f, lchunk_elem(c->q, i));
+    if (c->out[i]->type == LVAL_ERR) {
+      lchunk_drop(c, i + 1);
+      break;
+    }
+  }
+}
+
+static void lchunk_reduce(ltask* t) {
+  lchunk* c = (lchunk*) t;
+  c->acc = lchunk_elem(c->q, c->from);
+  for (int i = c->from + 1; i < c->to; i++) {
+    c->acc = lval_call2(c->e, c->f, c->acc, lchunk_elem(c->q, i));
+    if (c->acc->type == LVAL_ERR) {
+      lchunk_drop(c, i + 1);
+      break;
+    }
+  }
+}
+
+/* Split the elements of "q" into slices and run "run" on each in the */
+/* pool, returning the slices once all have finished */
+static lchunk* lchunk_run(lenv* e, lval* f, lval* q, lval** out,
+			  void (*run)(ltask*), int* nchunks) {
+  lpool* p = lpool_get();
+  int n = lchunk_count(p, q->count);
+  lchunk* cs = malloc(sizeof(lchunk) * n);
+  lgroup g;
+  lgroup_init(&g);
+  for (int k = 0; k < n; k++) {
+    lchunk* c = &cs[k];
+    c->task.run = run;
+    c->e = e;
+    c->f = f;
+    c->q = q;
+    c->from = (int) ((long) q->count * k / n);
+    c->to = (int) ((long) q->count * (k + 1) / n);
+    c->out = out;
+    c->acc = NULL;
+  }
+
+  /* Queue in reverse so the caller starts on the first slice itself */
+  for (int k = n-1; k >= 0; k--) { lpool_submit(p, &g, &cs[k].task); }
+  lgroup_wait(p, &g);
+  *nchunks = n;
+  return cs;
+}
+
+/* Map "f" over the list or range "q" in the pool, consuming both */
+lval* lval_pmap(lenv* e, lval* f, lval* q) {
+  lval** out = calloc(q->count ? q->count : 1, sizeof(lval*));
+  int n;
+  free(lchunk_run(e, f, q, out, lchunk_map, &n));
+
+  /* Report the first error in list order. Slices stop at their first */
+  /* error, so an error always comes before any element left unset. */
+  int i = 0;
+  while (i < q->count && out[i]->type != LVAL_ERR) { i++; }
+  lval* r;
+  if (i < q->count) {
+    r = out[i];
+    for (int j = 0; j < q->count; j++) {
+      if (j != i && out[j]) { lval_del(out[j]); }
+    }
+    free(out);
+  } else {
+    r = lval_qexpr();
+    r->cell = out;
+    r->count = q->count;
+  }
+
+  if (q->type != LVAL_RANGE) { q->count = 0; }
+  lval_del(q);
+  lval_del(f);
+  return r;
+}
+
+lval* builtin_pmap(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("pmap", a, 2);
+  LASSERT_TYPE("pmap", a, 0, LVAL_FUN);
+  LASSERT_LIST("pmap", a, 1);
+
+  lval* f = lval_pop(a, 0);
+  return lval_pmap(e, f, lval_take(a, 0));
+}
+
+lval* builtin_pfor_range(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT(a, a->count >= 2 && a->count <= 4,
+    "Function 'pfor-range' passed incorrect number of arguments. "
+    "Got %i, Expected 2 to 4.", a->count);
+  LASSERT_TYPE("pfor-range", a, 0, LVAL_FUN);
+
+  /* The remaining arguments are those of range */
+  lval* f = lval_pop(a, 0);
+  lval* r = builtin_range(e, a);
+  if (r->type == LVAL_ERR) {
+    lval_del(f);
+    return r;
+  }
+  return lval_pmap(e, f, r);
+}
+
+lval* builtin_preduce(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("preduce", a, 2);
+  LASSERT_TYPE("preduce", a, 0, LVAL_FUN);
+  LASSERT_LIST("preduce", a, 1);
+  LASSERT_NOT_EMPTY("preduce", a, 1);
+
+  /* Reduce every slice in the pool, then combine the slices in order */
+  lval* f = lval_pop(a, 0);
+  lval* q = lval_take(a, 0);
+  int n;
+  lchunk* cs = lchunk_run(e, f, q, NULL, lchunk_reduce, &n);
+
+  lval* acc = cs[0].acc;
+  for (int k = 1; k < n; k++) {
+    if (acc->type == LVAL_ERR) {
+      lval_del(cs[k].acc);
+    } else if (cs[k].acc->type == LVAL_ERR) {
+      lval_del(acc);
+      acc = cs[k].acc;
+    } else {
+      acc = lval_call2(e, f, acc, cs[k].acc);
+    }
+  }
+
+  free(cs);
+  if (q->type != LVAL_RANGE) { q->count = 0; }
+  lval_del(q);
+  lval_del(f);
+  return acc;
+}
+
+/**************************************************************************/
+/******************** FUTURES *********************************************/
+/**************************************************************************/
+
+/* Coroutines and threads waiting for something to happen, listed under */
+/* a lock so that whoever makes it happen can wake them. The scheduler */
+/* below parks and wakes them. */
+typedef struct lwaiter lwaiter;
+
+typedef struct {
+  pthread_mutex_t lock;
+  lwaiter* head;
+} lwaitq;
+
+static int lwaitq_wait(lwaitq* q, int* word, int seen);
+static void lwaitq_wake(lwaitq* q);
+
+static int lsched_in_co(void);
+
+/* An expression evaluated in the pool while its creator carries on. It */
+/* is owned by every handle to it and by its task until that has run. */
+struct lfuture {
+  ltask task;
+  int refs;
+  /* Expression and a snapshot of the environment, until evaluated */
+  lval* expr;
+  lenv* env;
+  /* Set by whichever thread evaluates it, its task or a waiter */
+  int claimed;
+  /* Value of the expression, NULL while pending, and a flag for the */
+  /* coroutines waiting for it */
+  lval* result;
+  int resolved;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  lwaitq waiters;
+};
+
+lfuture* lfuture_share(lfuture* f) {
+  LREF_INC(f->refs);
+  return f;
+}
+
+void lfuture_release(lfuture* f) {
+  if (LREF_DEC(f->refs) > 0) { return; }
+  if (f->expr) { lval_del(f->expr); }
+  if (f->env) { lenv_del(f->env); }
+  if (f->result) { lval_del(f->result); }
+  pthread_mutex_destroy(&f->lock);
+  pthread_cond_destroy(&f->done);
+  pthread_mutex_destroy(&f->waiters.lock);
+  free(f);
+}
+
+static lval* lfuture_result(lfuture* f) {
+  return __atomic_load_n(&f->result, __ATOMIC_ACQUIRE);
+}
+
+/* Evaluate "f" if no other thread has started to, and wake its waiters */
+static void lfuture_eval(lfuture* f) {
+  if (__atomic_exchange_n(&f->claimed, 1, __ATOMIC_ACQ_REL)) { return; }
+  lval* x = f->expr;
+  f->expr = NULL;
+  x->type = LVAL_SEXPR;
+  lval* r = lval_eval(f->env, x);
+  lenv_del(f->env);
+  f->env = NULL;
+
+  pthread_mutex_lock(&f->lock);
+  __atomic_store_n(&f->result, r, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&f->done);
+  pthread_mutex_unlock(&f->lock);
+  __atomic_store_n(&f->resolved, 1, __ATOMIC_SEQ_CST);
+  lwaitq_wake(&f->waiters);
+}
+
+static void lfuture_run(ltask* t) {
+  lfuture* f = (lfuture*) t;
+  lfuture_eval(f);
+  lfuture_release(f);
+}
+
+/* Wait until "f" is resolved. A future nobody has started is evaluated */
+/* by the waiter itself, unless that is a coroutine with its small stack. */
+/* No other task is run meanwhile, as it could be waiting for the caller */
+/* in turn. A coroutine parks, anything else blocks. */
+static void lfuture_wait(lfuture* f) {
+  if (!lsched_in_co() && !__atomic_load_n(&f->claimed, __ATOMIC_ACQUIRE)) {
+    ltask_depth++;
+    lfuture_eval(f);
+    ltask_depth--;
+  }
+  while (!lfuture_result(f)) {
+    if (lwaitq_wait(&f->waiters, &f->resolved, 0)) { continue; }
+    pthread_mutex_lock(&f->lock);
+    while (!lfuture_result(f)) { pthread_cond_wait(&f->done, &f->lock); }
+    pthread_mutex_unlock(&f->lock);
+  }
+}
+
+/* Copy of "e" for another thread to evaluate in while "e" goes on */
+/* changing. Its bindings are frozen in place, so that the copy shares */
+/* them rather than copying them, unless "e" may be read by other tasks */
+/* at the same time. */
+static lenv* lenv_snapshot(lenv* e) {
+  if (!lpool_in_task()) {
+    for (int i = 0; i < e->count; i++) { e->vals[i] = lval_intern(e->vals[i]); }
+  }
+  return lenv_copy(e);
+}
+
+lval* builtin_future(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("future", a, 1);
+  LASSERT_TYPE("future", a, 0, LVAL_QEXPR);
+
+  /* The expression sees the environment as it is now, so later */
+  /* definitions cannot race with its evaluation */
+  lfuture* f = malloc(sizeof(lfuture));
+  f->task.run = lfuture_run;
+  f->refs = 2;
+  f->expr = lval_take(a, 0);
+  f->env = lenv_snapshot(e);
+  f->claimed = 0;
+  f->result = NULL;
+  f->resolved = 0;
+  pthread_mutex_init(&f->lock, NULL);
+  pthread_cond_init(&f->done, NULL);
+  pthread_mutex_init(&f->waiters.lock, NULL);
+  f->waiters.head = NULL;
+
+  /* With the queue full, evaluate now rather than queue without bound */
+  if (!lpool_post(lpool_get(), &f->task)) { ltask_run(&f->task); }
+  return lval_fut(f);
+}
+
+lval* builtin_await(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("await", a, 1);
+  LASSERT_TYPE("await", a, 0, LVAL_FUT);
+
+  lfuture* f = a->cell[0]->fut;
+  lfuture_wait(f);
+  lval* r = lval_copy(f->result);
+  lval_del(a);
+  return r;
+}
+
+lval* builtin_poll(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("poll", a, 1);
+  LASSERT_TYPE("poll", a, 0, LVAL_FUT);
+
+  lval* r = lval_num(lfuture_result(a->cell[0]->fut) != NULL);
+  lval_del(a);
+  return r;
+}
+
+/**************************************************************************/
+/******************** CHANNELS ********************************************/
+/**************************************************************************/
+
+#ifdef __linux__
+/* Sleep while "*addr" still holds "val", or until woken */
+static void lfutex_wait(int* addr, int val) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void lfutex_wake(int* addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#else
+/* Elsewhere waiting threads simply poll */
+static void lfutex_wait(int* addr, int val) { sched_yield(); }
+static void lfutex_wake(int* addr) {}
+#endif
+
+/* Bounded queue of values. A value sent is moved into the queue whole */
+/* and handed to the receiver as it is, since its sender owned it alone. */
+/* Each end counts its operations in a word that the other end waits on */
+/* while the queue is full or empty: coroutines in a wait queue, and */
+/* threads with none to run asleep on the word itself. */
+struct lchan {
+  int refs;
+  lring ring;
+  int sent;
+  int taken;
+  int waiting;
+  lwaitq senders;
+  lwaitq receivers;
+};
+
+lchan* lchan_new(long cap) {
+  lchan* c = malloc(sizeof(lchan));
+  c->refs = 1;
+  lring_init(&c->ring, cap);
+  c->sent = 0;
+  c->taken = 0;
+  c->waiting = 0;
+  pthread_mutex_init(&c->senders.lock, NULL);
+  c->senders.head = NULL;
+  pthread_mutex_init(&c->receivers.lock, NULL);
+  c->receivers.head = NULL;
+  return c;
+}
+
+lchan* lchan_share(lchan* c) {
+  LREF_INC(c->refs);
+  return c;
+}
+
+void lchan_release(lchan* c) {
+  if (LREF_DEC(c->refs) > 0) { return; }
+  lval* v;
+  while ((v = lring_pop(&c->ring))) { lval_del(v); }
+  free(c->ring.slots);
+  pthread_mutex_destroy(&c->senders.lock);
+  pthread_mutex_destroy(&c->receivers.lock);
+  free(c);
+}
+
+/* Count an operation in "*word" and wake whoever waits on it */
+static void lchan_signal(lchan* c, lwaitq* q, int* word) {
+  __atomic_add_fetch(word, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&c->waiting, __ATOMIC_SEQ_CST)) { lfutex_wake(word); }
+  lwaitq_wake(q);
+}
+
+/* Sleep until "*word" moves on from "seen". The count is read before */
+/* the queue is tried, so a change in between makes the wait return. */
+static void lchan_sleep(lchan* c, int* word, int seen) {
+  __atomic_add_fetch(&c->waiting, 1, __ATOMIC_SEQ_CST);
+  lfutex_wait(word, seen);
+  __atomic_sub_fetch(&c->waiting, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Wait until "*word" moves on from "seen". A budget that has run out, */
+/* as when its session closed or its time is up, ends the wait with its */
+/* error instead. */
+static lval* lchan_wait(lchan* c, lwaitq* q, int* word, int seen) {
+  if (lbudget_expired()) {
+    lval* err = lbudget_check();
+    if (err) { return err; }
+  }
+  if (!lwaitq_wait(q, word, seen)) { lchan_sleep(c, word, seen); }
+  return NULL;
+}
+
+/* While the queue is full, other coroutines of the thread run. Returns */
+/* NULL once "v" is sent, or an error having deleted it. */
+lval* lchan_send(lchan* c, lval* v) {
+  for (;;) {
+    int seen = __atomic_load_n(&c->taken, __ATOMIC_SEQ_CST);
+    if (lring_push(&c->ring, v)) { break; }
+    lval* err = lchan_wait(c, &c->senders, &c->taken, seen);
+    if (err) {
+      lval_del(v);
+      return err;
+    }
+  }
+  lchan_signal(c, &c->receivers, &c->sent);
+  return NULL;
+}
+
+/* The oldest value in "c", waiting for one if "block" is set, or NULL */
+lval* lchan_recv(lchan* c, int block) {
+  for (;;) {
+    int seen = __atomic_load_n(&c->sent, __ATOMIC_SEQ_CST);
+    lval* v = lring_pop(&c->ring);
+    if (v) {
+      lchan_signal(c, &c->senders, &c->taken);
+      return v;
+    }
+    if (!block) { return NULL; }
+    lval* err = lchan_wait(c, &c->receivers, &c->sent, seen);
+    if (err) { return err; }
+  }
+}
+
+/* Largest number of values a channel may hold */
+#define LCHAN_MAX (1 << 24)
+
+lval* builtin_chan(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("chan", a, 1);
+  LASSERT_TYPE("chan", a, 0, LVAL_NUM);
+  long cap = a->cell[0]->num;
+  LASSERT(a, cap > 0 && cap <= LCHAN_MAX,
+    "Function 'chan' passed a capacity of %li, Expected 1 to %i.",
+    cap, LCHAN_MAX);
+
+  lval_del(a);
+  return lval_chan(lchan_new(cap));
+}
+
+lval* builtin_send(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("send", a, 2);
+  LASSERT_TYPE("send", a, 0, LVAL_CHAN);
+
+  /* Move the value out as it is, frozen parts and all */
+  lval* v = a->cell[1];
+  a->count = 1;
+  lval* err = lchan_send(a->cell[0]->chan, v);
+  lval_del(a);
+  return err ? err : lval_sexpr();
+}
+
+lval* builtin_recv(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("recv", a, 1);
+  LASSERT_TYPE("recv", a, 0, LVAL_CHAN);
+
+  lval* v = lchan_recv(a->cell[0]->chan, 1);
+  lval_del(a);
+  return v;
+}
+
+lval* builtin_try_recv(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("try-recv", a, 1);
+  LASSERT_TYPE("try-recv", a, 0, LVAL_CHAN);
+
+  /* A value comes wrapped as {v}, and an empty channel gives {} */
+  lval* v = lchan_recv(a->cell[0]->chan, 0);
+  lval_del(a);
+  lval* r = lval_qexpr();
+  return v ? lval_add(r, v) : r;
+}
+
+/**************************************************************************/
+/******************** COROUTINES ******************************************/
+/**************************************************************************/
+
+/* Room for the evaluator's recursion in each coroutine. Stacks are */
+/* mapped lazily, so a coroutine only uses the pages it has touched. */
+#define LCO_STACK (256 * 1024)
+
+/* Coroutines of a thread take turns on it. Each runs on a stack of its */
+/* own until it yields, blocks, or finishes, and the scheduler then */
+/* resumes the next one that is ready. */
+struct lco {
+  int refs;
+  ucontext_t ctx;
+  char* stack;
+  /* Function it runs, which must leave a result, and its data */
+  void (*run)(lco*);
+  void* data;
+  /* Expression and the environment it runs in, until it starts */
+  lval* expr;
+  lenv* env;
+  /* Value of the expression, NULL until it finishes */
+  lval* result;
+  /* Context and budget of its evaluation, kept while others run */
+  lctx* context;
+  lbudget* budget;
+  /* Scheduler of the thread that spawned it, and the next ready one */
+  struct lsched* owner;
+  lco* next;
+  /* Coroutines parked until it finishes */
+  lwaiter* joiners;
+};
+
+typedef struct lsched {
+  lco* head;
+  lco* tail;
+  /* Coroutine running now, NULL on the thread's own stack */
+  lco* current;
+  ucontext_t main;
+  /* Event loop of the thread, created on first use, and the number of */
+  /* waits parked until their file is ready or they are woken, the */
+  /* thread's own included */
+  int epfd;
+  int polling;
+  int parked;
+  /* Counter in the event loop that other threads bump to wake it, and */
+  /* the coroutines they woke, last first */
+  int evfd;
+  lco* woken;
+  /* Waits of coroutines in wait queues, which end early once their */
+  /* budget runs out, and the soonest deadline of those, 0 for none */
+  lwaiter* blocked;
+  long deadline;
+} lsched;
+
+static __thread lsched lsched_self;
+
+/* Context whose input the current thread is evaluating */
+static __thread lctx* lctx_current = NULL;
+
+lco* lco_share(lco* c) {
+  LREF_INC(c->refs);
+  return c;
+}
 
-#define LASSERT_TYPE(func, args, index, expect) \
-  LASSERT(args, args->cell[index]->type == expect,\
-    "Function '%s' passed incorrect type for argument %i. Got %s, Expected %s.",\
-	  func, index, ltype_name(args->cell[index]->type), ltype_name(expect))
+void lco_release(lco* c) {
+  if (LREF_DEC(c->refs) > 0) { return; }
+  if (c->expr) { lval_del(c->expr); }
+  if (c->result) { lval_del(c->result); }
+  if (c->stack) { munmap(c->stack, LCO_STACK); }
+  free(c);
+}
 
-#define LASSERT_NUM(func, args, num) \
-  LASSERT(args, args->count == num, \
-    "Function '%s' passed incorrect number of arguments. Got %i, Expected %i.",\
-    func, args->count, num);
+static void lsched_push(lsched* s, lco* c) {
+  c->next = NULL;
+  if (s->tail) { s->tail->next = c; } else { s->head = c; }
+  s->tail = c;
+}
 
-#define LASSERT_NOT_EMPTY(func, args, index) \
-  LASSERT(args, args->cell[index]->count != 0, \
-	  "Function '%s' passed {} for argument %i.", func, index);
+static lco* lsched_pop(lsched* s) {
+  lco* c = s->head;
+  if (c) {
+    s->head = c->next;
+    if (!s->head) { s->tail = NULL; }
+  }
+  return c;
+}
 
-lval* lval_eval(lenv* e, lval* v);
+/* A wait for a file to become ready or in a wait queue, by a coroutine */
+/* or by the thread on its own stack if "co" is NULL */
+struct lwaiter {
+  lco* co;
+  int ready;
+  lsched* owner;
+  /* Queue it waits in and the next waiter there */
+  lwaitq* queue;
+  lwaiter* next;
+  /* Neighbours in its scheduler's blocked waits */
+  lwaiter* prev_blocked;
+  lwaiter* next_blocked;
+};
 
-lval* builtin_head(lenv* e, lval* a) {
-  /* Check error conditions */
-  LASSERT_NUM("head", a, 1);
-  LASSERT_TYPE("head", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("head", a, 0);
+/* Create the thread's event loop if it has none. Returns -1 on failure. */
+static int lsched_events(lsched* s) {
+  if (s->polling) { return 0; }
+  s->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (s->epfd < 0) { return -1; }
+  s->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  if (s->evfd < 0 || epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->evfd, &ev) < 0) {
+    if (s->evfd >= 0) { close(s->evfd); }
+    close(s->epfd);
+    return -1;
+  }
+  s->polling = 1;
+  return 0;
+}
 
-  /* Otherwise take first argument */
-  lval* v = lval_take(a, 0);
+/* Collect the files that became ready within "timeout" milliseconds, */
+/* and queue the coroutines that were parked on them */
+static void lsched_poll(lsched* s, int timeout) {
+  struct epoll_event ev[64];
+  int n = epoll_wait(s->epfd, ev, 64, timeout);
+  for (int i = 0; i < n; i++) {
+    lwaiter* w = ev[i].data.ptr;
+    if (!w) {
+      /* Another thread woke the loop, the coroutines are in "woken" */
+      uint64_t count;
+      read(s->evfd, &count, sizeof(count));
+      continue;
+    }
+    w->ready = 1;
+    s->parked--;
+    if (w->co) { lsched_push(s, w->co); }
+  }
+}
 
-  /* Delete all elements that are not head and return */
-  while (v->count > 1) {
-    lval_del(lval_pop(v, 1));
+/* Queue the coroutines that other threads woke, in the order they did */
+static void lsched_drain(lsched* s) {
+  lco* c = __atomic_exchange_n(&s->woken, NULL, __ATOMIC_ACQUIRE);
+  lco* r = NULL;
+  while (c) {
+    lco* next = c->next;
+    c->next = r;
+    r = c;
+    c = next;
+  }
+  while (r) {
+    lco* next = r->next;
+    s->parked--;
+    lsched_push(s, r);
+    r = next;
   }
-  return v;
 }
 
-lval* builtin_tail(lenv* e, lval* a) {
-  /* Check error conditions */
-  LASSERT_NUM("tail", a, 1);
-  LASSERT_TYPE("tail", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("tail", a, 0);
+/* End the wait "w", which is in no queue any more, from any thread. The */
+/* waiting thread may return as soon as it sees "ready", so nothing of */
+/* "w" is touched after that. */
+static void lsched_wake(lwaiter* w) {
+  lsched* s = w->owner;
+  lco* c = w->co;
+  if (s == &lsched_self) {
+    w->ready = 1;
+    if (c) {
+      s->parked--;
+      lsched_push(s, c);
+    }
+    return;
+  }
 
-  /* Take first argument */
-  lval* v = lval_take(a, 0);
+  if (c) {
+    w->ready = 1;
+    c->next = __atomic_load_n(&s->woken, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s->woken, &c->next, c, 1,
+					__ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+  } else {
+    __atomic_store_n(&w->ready, 1, __ATOMIC_RELEASE);
+  }
+  uint64_t one = 1;
+  write(s->evfd, &one, sizeof(one));
+}
 
-  /* Delete first element and return */
-  lval_del(lval_pop(v, 0));
-  return v;
+static void lco_main(void) {
+  lco* c = lsched_self.current;
+  c->run(c);
 }
 
-lval* builtin_list(lenv* e, lval* a) {
-  a->type = LVAL_QEXPR;
-  return a;
+/* Evaluate the expression the coroutine was spawned with */
+static void lco_eval(lco* c) {
+  lval* x = c->expr;
+  c->expr = NULL;
+  x->type = LVAL_SEXPR;
+  c->result = lval_eval(c->env, x);
 }
 
-lval* builtin_eval(lenv* e, lval* a) {
-  /* Check error conditions */
-  LASSERT_NUM("eval", a, 1);
-  LASSERT_TYPE("eval", a, 0, LVAL_QEXPR);
+/* Run "c" from the thread's own stack until it yields or finishes. A */
+/* finished coroutine returns to "main" through its link and loses the */
+/* scheduler's reference. */
+static void lsched_resume(lsched* s, lco* c) {
+  lctx* context = lctx_current;
+  lbudget* budget = lbudget_cur;
+  lctx_current = c->context;
+  lbudget_cur = c->budget;
+
+  s->current = c;
+  swapcontext(&s->main, &c->ctx);
+  s->current = NULL;
+
+  c->context = lctx_current;
+  c->budget = lbudget_cur;
+  lctx_current = context;
+  lbudget_cur = budget;
+
+  if (c->result) {
+    while (c->joiners) {
+      lwaiter* w = c->joiners;
+      c->joiners = w->next;
+      lsched_wake(w);
+    }
+    if (c->budget && --c->budget->cos == 0 && c->budget->closer) {
+      s->parked--;
+      lsched_push(s, c->budget->closer);
+    }
+    munmap(c->stack, LCO_STACK);
+    c->stack = NULL;
+    lco_release(c);
+  }
+}
 
-  lval* x = lval_take(a, 0);
-  x->type = LVAL_SEXPR;
-  return lval_eval(e, x);
+/* Take "w" out of "q". Returns 0 if a waker has taken it already. */
+static int lwaitq_remove(lwaitq* q, lwaiter* w) {
+  pthread_mutex_lock(&q->lock);
+  lwaiter** p = &q->head;
+  while (*p && *p != w) { p = &(*p)->next; }
+  int listed = (*p != NULL);
+  if (listed) { *p = w->next; }
+  pthread_mutex_unlock(&q->lock);
+  return listed;
 }
 
-lval* builtin_join(lenv* e, lval* a) {
+/* Wake the thread's coroutines waiting in queues whose budget has run */
+/* out or is past its deadline, so that they see it, and find the */
+/* soonest deadline of the rest */
+static void lsched_expire(lsched* s) {
+  long now = lclock_ms();
+  s->deadline = 0;
+  for (lwaiter* w = s->blocked; w; w = w->next_blocked) {
+    lbudget* b = w->co->budget;
+    if (!b) { continue; }
+    if (b->spent || (b->deadline && now > b->deadline)) {
+      if (lwaitq_remove(w->queue, w)) { lsched_wake(w); }
+    } else if (b->deadline && (!s->deadline || b->deadline < s->deadline)) {
+      s->deadline = b->deadline;
+    }
+  }
+}
 
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE("join", a, i, LVAL_QEXPR);
+/* Let the thread's other coroutines run: the current coroutine goes to */
+/* the back of the queue, or, outside any coroutine, every coroutine */
+/* ready now gets one turn, once some are. Returns 0 if the caller must */
+/* block instead, inside a parallel task or with nothing else to run. */
+int lsched_wait(void) {
+  lsched* s = &lsched_self;
+  if (lpool_in_task()) { return 0; }
+
+  if (s->current) {
+    lco* c = s->current;
+    lsched_push(s, c);
+    swapcontext(&c->ctx, &s->main);
+    return 1;
   }
 
-  lval* x = lval_pop(a, 0);
+  /* Pick up coroutines woken by other threads or whose files are ready, */
+  /* sleeping in the event loop if none can run until then */
+  if (s->parked) {
+    lsched_drain(s);
+    long now = s->deadline ? lclock_ms() : 0;
+    if (s->deadline && now > s->deadline) { lsched_expire(s); }
+    int timeout = -1;
+    if (s->head) {
+      timeout = 0;
+    } else if (s->deadline) {
+      timeout = (int) (s->deadline - now + 1);
+    }
+    lsched_poll(s, timeout);
+    lsched_drain(s);
+  }
 
-  while (a->count) {
-    x = lval_join(x, lval_pop(a, 0));
+  lco* last = s->tail;
+  if (!last) { return s->parked > 0; }
+  for (lco* c = NULL; c != last; ) {
+    c = lsched_pop(s);
+    lsched_resume(s, c);
   }
+  return 1;
+}
 
-  lval_del(a);
-  return x;
+/* Wait in "q" until "*word" moves on from "seen": a coroutine parks and */
+/* the thread on its own stack runs the others meanwhile. Returns 0 if */
+/* the caller must block instead, inside a parallel task or with no */
+/* coroutines to run. */
+static int lwaitq_wait(lwaitq* q, int* word, int seen) {
+  lsched* s = &lsched_self;
+  if (lpool_in_task() || (!s->current && !s->head && !s->parked)
+      || lsched_events(s) < 0) {
+    return 0;
+  }
+
+  lwaiter w;
+  memset(&w, 0, sizeof(w));
+  w.co = s->current;
+  w.owner = s;
+  w.queue = q;
+  pthread_mutex_lock(&q->lock);
+  w.next = q->head;
+  __atomic_store_n(&q->head, &w, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&q->lock);
+
+  /* A change made before the waiter was listed would never wake it. If */
+  /* it is no longer listed, its waker is already on the way. */
+  if (__atomic_load_n(word, __ATOMIC_SEQ_CST) != seen
+      && lwaitq_remove(q, &w)) {
+    return 1;
+  }
+
+  s->parked++;
+  if (w.co) {
+    lbudget* b = lbudget_cur;
+    if (b && b->deadline && (!s->deadline || b->deadline < s->deadline)) {
+      s->deadline = b->deadline;
+    }
+    w.next_blocked = s->blocked;
+    if (s->blocked) { s->blocked->prev_blocked = &w; }
+    s->blocked = &w;
+    swapcontext(&w.co->ctx, &s->main);
+    if (w.prev_blocked) { w.prev_blocked->next_blocked = w.next_blocked; }
+    else { s->blocked = w.next_blocked; }
+    if (w.next_blocked) { w.next_blocked->prev_blocked = w.prev_blocked; }
+  } else {
+    while (!__atomic_load_n(&w.ready, __ATOMIC_ACQUIRE)) { lsched_wait(); }
+    s->parked--;
+  }
+  return 1;
 }
 
-lval* builtin_cons(lenv* e, lval* a) {
-  /* Check error conditions */
-  LASSERT_NUM("cons", a, 2);
-  LASSERT_TYPE("cons", a, 1, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("cons", a, 0);
-  
-  /* Construct new Q-expr */
-  lval* x = lval_qexpr();
-  /* Add the value */
-  x = lval_add(x, lval_pop(a, 0));
-  /* Add the elements of the Q-expr */
-  while (a->cell[1]->count) {
-    x = lval_add(x, lval_pop(a->cell[1], 0));
+/* Take every waiter out of "q" and wake it */
+static void lwaitq_wake(lwaitq* q) {
+  if (!__atomic_load_n(&q->head, __ATOMIC_SEQ_CST)) { return; }
+  pthread_mutex_lock(&q->lock);
+  lwaiter* w = q->head;
+  q->head = NULL;
+  pthread_mutex_unlock(&q->lock);
+  while (w) {
+    lwaiter* next = w->next;
+    lsched_wake(w);
+    w = next;
   }
-  
-  lval_del(a);
-  return x;
-};
+}
 
-lval* builtin_len(lenv* e, lval* a) {
-  /* Check error conditions */
-  LASSERT_NUM("len", a, 1);
-  LASSERT_TYPE("len", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("len", a, 0);
-  
-  return lval_num(a->cell[0]->count);
-};
+/* Whether the current thread is running one of its coroutines */
+static int lsched_in_co(void) {
+  return lsched_self.current != NULL;
+}
 
-lval* builtin_init(lenv* e, lval* a) {
+/* Queue a new coroutine running "run" on the current thread, in the */
+/* context and under the budget of the caller. The scheduler holds one */
+/* reference until it finishes, the caller the other. Returns NULL if */
+/* no stack could be allocated. */
+lco* lco_start(void (*run)(lco*), void* data) {
+  char* stack = mmap(NULL, LCO_STACK, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (stack == MAP_FAILED) { return NULL; }
+
+  lco* c = malloc(sizeof(lco));
+  c->refs = 2;
+  c->stack = stack;
+  c->run = run;
+  c->data = data;
+  c->expr = NULL;
+  c->env = NULL;
+  c->result = NULL;
+  c->context = lctx_current;
+  c->budget = lbudget_cur;
+  if (c->budget) { c->budget->cos++; }
+  c->owner = &lsched_self;
+  c->joiners = NULL;
+  getcontext(&c->ctx);
+  c->ctx.uc_stack.ss_sp = stack;
+  c->ctx.uc_stack.ss_size = LCO_STACK;
+  c->ctx.uc_link = &lsched_self.main;
+  makecontext(&c->ctx, lco_main, 0);
+
+  lsched_push(&lsched_self, c);
+  return c;
+}
+
+lval* builtin_spawn(lenv* e, lval* a) {
   /* Check error conditions */
-  LASSERT_NUM("init", a, 1);
-  LASSERT_TYPE("init", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("init", a, 0);
+  LASSERT_NUM("spawn", a, 1);
+  LASSERT_TYPE("spawn", a, 0, LVAL_QEXPR);
+  LASSERT(a, !lpool_in_task(),
+    "Function 'spawn' cannot be used inside a parallel task.");
+
+  /* Runs in the spawning environment, seeing its definitions as they */
+  /* are whenever it resumes */
+  lco* c = lco_start(lco_eval, NULL);
+  LASSERT(a, c, "Function 'spawn' could not allocate a stack.");
+  c->expr = lval_take(a, 0);
+  c->env = e;
+  return lval_co(c);
+}
 
-  /* Take first argument */
-  lval* v = lval_take(a, 0);
+/* Give the other coroutines a turn, then return the argument. A call */
+/* always has one, as a lone symbol in parentheses is not called. */
+lval* builtin_yield(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("yield", a, 1);
+  LASSERT(a, !lpool_in_task(),
+    "Function 'yield' cannot be used inside a parallel task.");
 
-  /* Delete last element and return */
-  lval_del(lval_pop(v, v->count-1));
-  return v;
+  lsched_wait();
+  return lval_take(a, 0);
 }
 
-lval* builtin_last(lenv* e, lval* a) {
+lval* builtin_join_co(lenv* e, lval* a) {
   /* Check error conditions */
-  LASSERT_NUM("last", a, 1);
-  LASSERT_TYPE("last", a, 0, LVAL_QEXPR);
-  LASSERT_NOT_EMPTY("last", a, 0);
+  LASSERT(a, !lpool_in_task(),
+    "Function 'join' cannot be used inside a parallel task.");
+  lco* c = a->cell[0]->co;
+  LASSERT(a, c->owner == &lsched_self,
+    "Function 'join' passed a coroutine spawned on another thread.");
+  LASSERT(a, c != lsched_self.current,
+    "Function 'join' passed the coroutine that is running it.");
+
+  /* A coroutine parks until "c" finishes, and the thread runs the others */
+  lsched* s = &lsched_self;
+  if (!c->result && s->current) {
+    lwaiter w;
+    memset(&w, 0, sizeof(w));
+    w.co = s->current;
+    w.owner = s;
+    w.next = c->joiners;
+    c->joiners = &w;
+    s->parked++;
+    swapcontext(&w.co->ctx, &s->main);
+  }
+  while (!c->result) { lsched_wait(); }
+  lval* r = lval_copy(c->result);
+  lval_del(a);
+  return r;
+}
 
-  /* Otherwise take first argument */
-  lval* v = lval_take(a, 0);
+/**************************************************************************/
+/******************** ASYNCHRONOUS I/O ************************************/
+/**************************************************************************/
 
-  /* Delete all elements that are not last and return */
-  while (v->count > 1) {
-   lval_del(lval_pop(v, 0));
+/* Files are plain numbers, as in POSIX, always in non-blocking mode. An */
+/* operation that would block waits for the file in the thread's event */
+/* loop: a coroutine is parked there and the others run meanwhile, and */
+/* the thread itself runs its coroutines until the file is ready. Bytes */
+/* are read and written as Q-expressions of numbers. */
+
+/* Wait until "fd" is ready for "events". Returns -1 with "errno" set if */
+/* it cannot be waited on. */
+static int lio_wait(int fd, int events) {
+  lsched* s = &lsched_self;
+  if (lsched_events(s) < 0) { return -1; }
+
+  /* Coroutines park, anything else waits on its own stack */
+  lwaiter w = { lpool_in_task() ? NULL : s->current, 0 };
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = &w;
+
+  /* Regular files cannot be polled, as they are always ready */
+  if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    return (errno == EPERM) ? 0 : -1;
   }
-  return v;
+
+  /* Counted as parked, the thread's own wait also makes the scheduler */
+  /* poll while other coroutines keep running */
+  s->parked++;
+  if (w.co) {
+    swapcontext(&w.co->ctx, &s->main);
+  } else {
+    while (!w.ready) {
+      if (lpool_in_task()) { lsched_poll(s, -1); } else { lsched_wait(); }
+    }
+  }
+  epoll_ctl(s->epfd, EPOLL_CTL_DEL, fd, NULL);
+  return 0;
 }
 
-lval* builtin_def(lenv* e, lval* a) {
-  /* Check error conditions */
-  LASSERT_TYPE("def", a, 0, LVAL_QEXPR);
-  
-  /* First argument is symbol list */
-  lval* syms = a->cell[0];
+/* Largest number of bytes read at once */
+#define LIO_MAX (1 << 20)
 
-  /* Ensure all elements of first list are symbols */
-  for (int i = 0; i < syms->count; i++) {
-    LASSERT(a, (syms->cell[i]->type == LVAL_SYM),
-	    "Function 'def' cannot define non-symbol! "
-	    "Got %s, Expected %s.",
-	    ltype_name(syms->cell[i]->type), ltype_name(LVAL_SYM));
-  }
+/* A path or mode given as a one element Q-expression such as {name}, or */
+/* NULL if argument "i" is not one */
+static char* lio_name(lval* a, int i) {
+  lval* k = a->cell[i];
+  if (k->type != LVAL_QEXPR || k->count != 1) { return NULL; }
+  return (k->cell[0]->type == LVAL_SYM) ? k->cell[0]->sym : NULL;
+}
 
-  /* Check correct number of symbols and values */
-  LASSERT(a, (syms->count == a->count-1),
-	  "Function 'def' passed too many arguments for symbols. "
-	  "Got %i, Expected %i.",
-	  syms->count, a->count-1);
+#define LASSERT_NAME(func, args, index) \
+  LASSERT(args, lio_name(args, index), \
+    "Function '%s' passed incorrect type for argument %i. " \
+    "Expected a name such as {name}.", func, index)
 
-  /* Assign copies of values to symbols */
-  for (int i = 0; i < syms->count; i++) {
-    lenv_put(e, syms->cell[i], a->cell[i+1]);
-  }
+#define LASSERT_FD(func, args, index) \
+  LASSERT_TYPE(func, args, index, LVAL_NUM); \
+  LASSERT(args, args->cell[index]->num >= 0 && args->cell[index]->num <= INT_MAX, \
+    "Function '%s' passed %li, which is not a file.", \
+    func, args->cell[index]->num)
 
+/* Error for a failed system call, taking care of the arguments */
+static lval* lio_err(lval* a, char* func) {
+  lval* err = lval_err("Function '%s' failed: %s.", func, strerror(errno));
   lval_del(a);
-  return lval_sexpr();
+  return err;
 }
 
-lval* builtin_op(lenv* e, lval* a, char* op) {
-
-  /* Ensure all arguments are number */
-  for (int i = 0; i < a->count; i++) {
-    LASSERT_TYPE(op, a, i, LVAL_NUM);
+lval* builtin_open(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("open", a, 2);
+  LASSERT_NAME("open", a, 0);
+  LASSERT_NAME("open", a, 1);
+
+  char* mode = lio_name(a, 1);
+  int flags;
+  if (strcmp(mode, "r") == 0) { flags = O_RDONLY; }
+  else if (strcmp(mode, "w") == 0) { flags = O_WRONLY | O_CREAT | O_TRUNC; }
+  else if (strcmp(mode, "a") == 0) { flags = O_WRONLY | O_CREAT | O_APPEND; }
+  else {
+    LASSERT(a, 0, "Function 'open' passed mode '%s', Expected r, w or a.", mode);
   }
 
-  /* Pop the first element */
-  lval* x = lval_pop(a, 0);
+  int fd = open(lio_name(a, 0), flags | O_NONBLOCK | O_CLOEXEC, 0666);
+  if (fd < 0) { return lio_err(a, "open"); }
+  lval_del(a);
+  return lval_num(fd);
+}
 
-  /* If no arguments left and subtraction then perform unary negation */
-  if (strcmp(op, "-") == 0 && a->count == 0) {
-    x->num = -x->num;
-  }
+lval* builtin_close(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("close", a, 1);
+  LASSERT_FD("close", a, 0);
 
-  /* While there are still elements remaining */
-  while (a->count > 0) {
+  if (close(a->cell[0]->num) < 0) { return lio_err(a, "close"); }
+  lval_del(a);
+  return lval_sexpr();
+}
 
-    /* Pop the next element */
-    lval* y = lval_pop(a, 0);
-    
-    if (strcmp(op, "+") == 0) { x->num += y->num; } 
-    if (strcmp(op, "-") == 0) { x->num -= y->num; } 
-    if (strcmp(op, "*") == 0) { x->num *= y->num; } 
-    if (strcmp(op, "/") == 0) {
-      if (y->num == 0) {
-	lval_del(x);
-	lval_del(y);
-	x = lval_err("Division by zero!");
-	break;
-      }
-      x->num /= y->num;
-    }
-    if (strcmp(op, "%") == 0) {
-      if (y->num == 0) {
-	lval_del(x);
-	lval_del(y);
-	x = lval_err("Division by zero!");
-	break;
-      }
-      x->num %= y->num;
-    }
-    if (strcmp(op, "^") == 0) { x->num = (long) pow( x->num, y->num); }
-    if (strcmp(op, "min") == 0) {
-      x->num = (x->num < y->num) ? x->num : y->num;
-    }
-    if (strcmp(op, "max") == 0) {
-      x->num = (x->num > y->num) ? x->num : y->num;
+lval* builtin_read(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("read", a, 2);
+  LASSERT_FD("read", a, 0);
+  LASSERT_TYPE("read", a, 1, LVAL_NUM);
+  long n = a->cell[1]->num;
+  LASSERT(a, n > 0 && n <= LIO_MAX,
+    "Function 'read' passed a count of %li, Expected 1 to %i.", n, LIO_MAX);
+
+  /* Up to "n" bytes once any are available, {} at the end of the file */
+  int fd = a->cell[0]->num;
+  unsigned char* buf = malloc(n);
+  ssize_t got;
+  while ((got = read(fd, buf, n)) < 0) {
+    if ((errno != EAGAIN && errno != EINTR) || lio_wait(fd, EPOLLIN) < 0) {
+      free(buf);
+      return lio_err(a, "read");
     }
-    
-    lval_del(y);
   }
 
+  lval* q = lval_qexpr();
+  q->cell = malloc(sizeof(lval*) * (got ? got : 1));
+  for (ssize_t i = 0; i < got; i++) { q->cell[i] = lval_num(buf[i]); }
+  q->count = got;
+  free(buf);
   lval_del(a);
-  return x;
+  return q;
 }
 
-lval* builtin_add(lenv* e, lval* a) {
-  return builtin_op(e, a , "+");
+lval* builtin_write(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("write", a, 2);
+  LASSERT_FD("write", a, 0);
+  LASSERT_TYPE("write", a, 1, LVAL_QEXPR);
+  lval* q = a->cell[1];
+  for (int i = 0; i < q->count; i++) {
+    LASSERT(a, q->cell[i]->type == LVAL_NUM
+	    && q->cell[i]->num >= 0 && q->cell[i]->num <= 255,
+      "Function 'write' passed a list whose element %i is not a byte.", i);
+  }
+  LASSERT(a, q->count >= 0,
+    "Function 'write' passed a list of invalid length %i.", q->count);
+
+  size_t len = (size_t) q->count;
+  unsigned char* buf = malloc(len ? len : 1);
+  for (size_t i = 0; i < len; i++) { buf[i] = q->cell[i]->num; }
+
+  /* Write everything, waiting whenever the file is full */
+  int fd = a->cell[0]->num;
+  size_t done = 0;
+  while (done < len) {
+    ssize_t put = write(fd, buf + done, len - done);
+    if (put >= 0) { done += put; continue; }
+    if ((errno != EAGAIN && errno != EINTR) || lio_wait(fd, EPOLLOUT) < 0) {
+      free(buf);
+      return lio_err(a, "write");
+    }
+  }
+  free(buf);
+  lval_del(a);
+  return lval_num(done);
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-  return builtin_op(e, a , "-");
+lval* builtin_pipe(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("pipe", a, 1);
+  LASSERT_TYPE("pipe", a, 0, LVAL_NUM);
+  long size = a->cell[0]->num;
+  LASSERT(a, size >= 0 && size <= INT_MAX,
+    "Function 'pipe' passed a size of %li, Expected 0 to %i.", size, INT_MAX);
+
+  /* Returns {read write}, with a buffer of at least "size" bytes unless 0 */
+  int fds[2];
+  if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) { return lio_err(a, "pipe"); }
+  if (size > 0 && fcntl(fds[1], F_SETPIPE_SZ, (int) size) < 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return lio_err(a, "pipe");
+  }
+  lval_del(a);
+  lval* q = lval_add(lval_qexpr(), lval_num(fds[0]));
+  return lval_add(q, lval_num(fds[1]));
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-  return builtin_op(e, a , "*");
+/* Fill in the address of the Unix socket named by argument "i" */
+static int lio_unix_addr(const char* path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-  return builtin_op(e, a , "/");
+lval* builtin_unix_listen(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("unix-listen", a, 1);
+  LASSERT_NAME("unix-listen", a, 0);
+
+  struct sockaddr_un addr;
+  if (lio_unix_addr(lio_name(a, 0), &addr) < 0) { return lio_err(a, "unix-listen"); }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) { return lio_err(a, "unix-listen"); }
+  if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+      || listen(fd, SOMAXCONN) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return lio_err(a, "unix-listen");
+  }
+  lval_del(a);
+  return lval_num(fd);
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-  return builtin_op(e, a , "%");
+lval* builtin_unix_connect(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("unix-connect", a, 1);
+  LASSERT_NAME("unix-connect", a, 0);
+
+  struct sockaddr_un addr;
+  if (lio_unix_addr(lio_name(a, 0), &addr) < 0) { return lio_err(a, "unix-connect"); }
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) { return lio_err(a, "unix-connect"); }
+
+  /* A full backlog makes the connection wait for the listener */
+  while (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+    if (errno != EAGAIN || lio_wait(fd, EPOLLOUT) < 0) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return lio_err(a, "unix-connect");
+    }
+  }
+  lval_del(a);
+  return lval_num(fd);
 }
 
-lval* builtin_pow(lenv* e, lval* a) {
-  return builtin_op(e, a, "^");
+lval* builtin_accept(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("accept", a, 1);
+  LASSERT_FD("accept", a, 0);
+
+  int lfd = a->cell[0]->num;
+  int fd;
+  while ((fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0) {
+    if ((errno != EAGAIN && errno != EINTR) || lio_wait(lfd, EPOLLIN) < 0) {
+      return lio_err(a, "accept");
+    }
+  }
+  lval_del(a);
+  return lval_num(fd);
 }
 
-lval* builtin_min(lenv* e, lval* a) {
-  return builtin_op(e, a , "min");
+/* Wait "ms" milliseconds on a timer of its own. Returns -1 with "errno" */
+/* set if it cannot. */
+static int lio_sleep(long ms) {
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) { return -1; }
+  struct itimerspec t;
+  memset(&t, 0, sizeof(t));
+  t.it_value.tv_sec = ms / 1000;
+  t.it_value.tv_nsec = (ms % 1000) * 1000000 + (ms == 0);
+  timerfd_settime(fd, 0, &t, NULL);
+
+  uint64_t fired;
+  while (read(fd, &fired, sizeof(fired)) < 0) {
+    if ((errno != EAGAIN && errno != EINTR) || lio_wait(fd, EPOLLIN) < 0) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+  }
+  close(fd);
+  return 0;
 }
 
-lval* builtin_max(lenv* e, lval* a) {
-  return builtin_op(e, a , "max");
+lval* builtin_sleep(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("sleep", a, 1);
+  LASSERT_TYPE("sleep", a, 0, LVAL_NUM);
+  long ms = a->cell[0]->num;
+  LASSERT(a, ms >= 0, "Function 'sleep' passed a negative time of %li.", ms);
+
+  if (lio_sleep(ms) < 0) { return lio_err(a, "sleep"); }
+  lval_del(a);
+  return lval_sexpr();
+}
+
+FILE* lctx_output(lctx* c);
+
+/* Print the arguments separated by spaces on a line of their own, to the */
+/* output of the context evaluating them, or stdout */
+lval* builtin_print(lenv* e, lval* a) {
+  FILE* out = lctx_current ? lctx_output(lctx_current) : stdout;
+  for (int i = 0; i < a->count; i++) {
+    if (i > 0) { fputc(' ', out); }
+    lval_fprint(out, a->cell[i]);
+  }
+  fputc('\n', out);
+  lval_del(a);
+  return lval_sexpr();
 }
 
-void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+lval* builtin_load(lenv* e, lval* a);
+
+void lenv_add_builtin(lenv* e, const char* name, lbuiltin func) {
   lval* k = lval_sym(name);
   lval* v = lval_fun(func);
   lenv_put(e, k, v);
@@ -647,10 +5671,65 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "cons", builtin_cons);
   lenv_add_builtin(e, "len" , builtin_len );
   lenv_add_builtin(e, "last", builtin_last);
+  lenv_add_builtin(e, "nth", builtin_nth);
+  lenv_add_builtin(e, "range", builtin_range);
+  lenv_add_builtin(e, "sort", builtin_sort);
+  lenv_add_builtin(e, "sort-by", builtin_sort_by);
+  lenv_add_builtin(e, "bsearch", builtin_bsearch);
+  lenv_add_builtin(e, "unique", builtin_unique);
+  lenv_add_builtin(e, "map", builtin_map);
+  lenv_add_builtin(e, "filter", builtin_filter);
+  lenv_add_builtin(e, "fold", builtin_fold);
+  lenv_add_builtin(e, "reduce", builtin_reduce);
+
+  /* Sequence Functions */
+  lenv_add_builtin(e, "seq", builtin_seq);
+  lenv_add_builtin(e, "repeat", builtin_repeat);
+  lenv_add_builtin(e, "iterate", builtin_iterate);
+  lenv_add_builtin(e, "generate", builtin_generate);
+  lenv_add_builtin(e, "take", builtin_take);
+  lenv_add_builtin(e, "drop", builtin_drop);
+  lenv_add_builtin(e, "seq-map", builtin_seq_map);
+  lenv_add_builtin(e, "seq-filter", builtin_seq_filter);
+  lenv_add_builtin(e, "realize", builtin_realize);
+
+  /* Parallel Functions */
+  lenv_add_builtin(e, "pmap", builtin_pmap);
+  lenv_add_builtin(e, "preduce", builtin_preduce);
+  lenv_add_builtin(e, "pfor-range", builtin_pfor_range);
+  lenv_add_builtin(e, "future", builtin_future);
+  lenv_add_builtin(e, "await", builtin_await);
+  lenv_add_builtin(e, "poll", builtin_poll);
+  lenv_add_builtin(e, "chan", builtin_chan);
+  lenv_add_builtin(e, "send", builtin_send);
+  lenv_add_builtin(e, "recv", builtin_recv);
+  lenv_add_builtin(e, "try-recv", builtin_try_recv);
+  lenv_add_builtin(e, "spawn", builtin_spawn);
+  lenv_add_builtin(e, "yield", builtin_yield);
+
+  /* Input and Output Functions */
+  lenv_add_builtin(e, "open", builtin_open);
+  lenv_add_builtin(e, "close", builtin_close);
+  lenv_add_builtin(e, "read", builtin_read);
+  lenv_add_builtin(e, "write", builtin_write);
+  lenv_add_builtin(e, "pipe", builtin_pipe);
+  lenv_add_builtin(e, "unix-listen", builtin_unix_listen);
+  lenv_add_builtin(e, "unix-connect", builtin_unix_connect);
+  lenv_add_builtin(e, "accept", builtin_accept);
+  lenv_add_builtin(e, "sleep", builtin_sleep);
+  lenv_add_builtin(e, "print", builtin_print);
+  lenv_add_builtin(e, "load", builtin_load);
 
   /* Variable Functions */
   lenv_add_builtin(e, "def" , builtin_def );
 
+  /* Comparison Functions */
+  lenv_add_builtin(e, "equal?", builtin_equal);
+
+  /* Function Wrappers */
+  lenv_add_builtin(e, "memo", builtin_memo);
+  lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+
   /* Mathematical Functions */
   lenv_add_builtin(e, "+", builtin_add);
   lenv_add_builtin(e, "-", builtin_sub);
@@ -660,18 +5739,184 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "^", builtin_pow);
   lenv_add_builtin(e, "max", builtin_max);
   lenv_add_builtin(e, "min", builtin_min);
+
+  /* Array Functions */
+  lenv_add_builtin(e, "array", builtin_array);
+  lenv_add_builtin(e, "shape", builtin_shape);
+  lenv_add_builtin(e, "dot", builtin_dot);
+  lenv_add_builtin(e, "axpy", builtin_axpy);
+  lenv_add_builtin(e, "matmul", builtin_matmul);
+  lenv_add_builtin(e, "transpose", builtin_transpose);
+
+  /* Hash Map Functions */
+  lenv_add_builtin(e, "hmap", builtin_hmap);
+  lenv_add_builtin(e, "hget", builtin_hget);
+  lenv_add_builtin(e, "hput", builtin_hput);
+  lenv_add_builtin(e, "hdel", builtin_hdel);
+  lenv_add_builtin(e, "hkeys", builtin_hkeys);
+  lenv_add_builtin(e, "hlen", builtin_hlen);
 }
 
 /**************************************************************************/
 /******************** EVALUATION ******************************************/
 /**************************************************************************/
 
-lval* lval_eval_sexpr(lenv* e, lval* v) {
+/* Milliseconds on the monotonic clock */
+static long lclock_ms(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* Error if the current budget has run out, stopping the evaluation. The */
+/* clock is only read every so many steps, and a coroutine also stops */
+/* when its stack is nearly full, as its recursion would overflow it. */
+static lval* lbudget_check(void) {
+  lbudget* b = lbudget_cur;
+  lco* c = lsched_self.current;
+  if (!b->spent) {
+    if (c && (char*) &b - c->stack < LCO_STACK / 8) {
+      b->spent = LBUDGET_STACK;
+    } else if (b->max_nodes && b->nodes - b->base > b->max_nodes) {
+      b->spent = LBUDGET_MEMORY;
+    } else if (b->deadline && (++b->ticks & 1023) == 0
+	       && lclock_ms() > b->deadline) {
+      b->spent = LBUDGET_TIME;
+    }
+  }
+  switch (b->spent) {
+  case LBUDGET_TIME:   return lval_err("Evaluation ran out of time.");
+  case LBUDGET_MEMORY: return lval_err("Evaluation ran out of memory.");
+  case LBUDGET_STACK:  return lval_err("Evaluation nested too deeply.");
+  case LBUDGET_CLOSED: return lval_err("Evaluation stopped, as its session closed.");
+  }
+  return NULL;
+}
+
+/* Apply the function "f" to the argument list "a", going through its */
+/* call cache if it has one */
+lval* lval_call(lenv* e, lval* f, lval* a) {
+  if (lbudget_cur) {
+    lval* err = lbudget_check();
+    if (err) { lval_del(a); return err; }
+  }
+  if (f->memo) { return lmemo_call(e, f, a); }
+  return f->fun(e, a);
+}
+
+/* Evaluate large independent arguments in the pool when enabled */
+int lval_parallel = 0;
+
+/* Smallest argument, in nodes, worth a task of its own */
+#define LPAR_MIN_NODES 32
+
+/* Most nodes inspected when checking an argument for side effects */
+#define LPAR_SCAN_MAX (1 << 20)
+
+/* Number of nodes in "v", counting no further than "max" */
+static int lpar_size(lval* v, int max) {
+  int cap = 16;
+  int n = 1;
+  int size = 0;
+  lval** stack = malloc(sizeof(lval*) * cap);
+  stack[0] = v;
+  while (n > 0 && size < max) {
+    lval* x = stack[--n];
+    size++;
+    if (LVAL_IS_LIST(x)) { stack = lval_queue_cells(stack, &n, &cap, x); }
+  }
+  free(stack);
+  return size;
+}
+
+/* Builtins whose effects depend on the order arguments are evaluated in */
+static int lpar_barrier(lbuiltin f) {
+  return f == builtin_def || f == builtin_hput || f == builtin_hdel
+    || f == builtin_send || f == builtin_recv || f == builtin_try_recv
+    || f == builtin_spawn || f == builtin_yield || f == builtin_join
+    || f == builtin_open || f == builtin_close || f == builtin_read
+    || f == builtin_write || f == builtin_pipe || f == builtin_unix_listen
+    || f == builtin_unix_connect || f == builtin_accept
+    || f == builtin_sleep || f == builtin_print || f == builtin_load;
+}
+
+/* Whether evaluating "v" might change what its siblings read: whether it */
+/* names one of the builtins above. Q-expressions are searched since they */
+/* may be evaluated, and so are those bound to the symbols it names. */
+static int lpar_impure(lenv* e, lval* v) {
+  int cap = 16;
+  int n = 1;
+  int seen = 0;
+  int found = 0;
+  lval** stack = malloc(sizeof(lval*) * cap);
+  stack[0] = v;
+  while (!found && n > 0) {
+    lval* x = stack[--n];
+    if (++seen > LPAR_SCAN_MAX) { found = 1; }
+    if (x->type == LVAL_SYM) {
+      lval* b = lenv_peek(e, x);
+      if (b && b->type == LVAL_FUN) { found = lpar_barrier(b->fun); }
+      if (b && b->type == LVAL_QEXPR) { x = b; }
+    }
+    if (LVAL_IS_LIST(x)) { stack = lval_queue_cells(stack, &n, &cap, x); }
+  }
+  free(stack);
+  return found;
+}
+
+/* Evaluation of one argument in the pool, in place */
+typedef struct {
+  ltask task;
+  lenv* e;
+  lval** slot;
+} larg;
+
+static void larg_run(ltask* t) {
+  larg* a = (larg*) t;
+  *a->slot = lval_eval(a->e, *a->slot);
+}
+
+/* Evaluate the children of "v" in the pool if at least two of them are */
+/* large and none has side effects, returning 0 if they are not */
+static int lpar_eval_args(lenv* e, lval* v) {
+  int nbig = 0;
+  char* big = malloc(v->count);
+  for (int i = 0; i < v->count; i++) {
+    big[i] = v->cell[i]->type == LVAL_SEXPR
+      && lpar_size(v->cell[i], LPAR_MIN_NODES) >= LPAR_MIN_NODES;
+    nbig += big[i];
+  }
+  for (int i = 0; nbig > 1 && i < v->count; i++) {
+    if (lpar_impure(e, v->cell[i])) { nbig = 0; }
+  }
+  if (nbig < 2) {
+    free(big);
+    return 0;
+  }
 
-  /* Evaluate children */
+  /* Queue the large arguments and evaluate the small ones meanwhile */
+  lpool* p = lpool_get();
+  larg* args = malloc(sizeof(larg) * nbig);
+  lgroup g;
+  lgroup_init(&g);
+  for (int i = v->count-1, k = 0; i >= 0; i--) {
+    if (!big[i]) { continue; }
+    args[k].task.run = larg_run;
+    args[k].e = e;
+    args[k].slot = &v->cell[i];
+    lpool_submit(p, &g, &args[k++].task);
+  }
   for (int i = 0; i < v->count; i++) {
-    v->cell[i] = lval_eval(e, v->cell[i]);
+    if (!big[i]) { v->cell[i] = lval_eval(e, v->cell[i]); }
   }
+  lgroup_wait(p, &g);
+  free(args);
+  free(big);
+  return 1;
+}
+
+/* Call the function at the head of "v", whose children are evaluated */
+lval* lval_apply(lenv* e, lval* v) {
 
   /* Error checking */
   for (int i = 0; i < v->count; i++) {
@@ -697,10 +5942,316 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
   }
 
   /* If so call function to get the result */
-  lval* result = f->fun(e, v);
+  lval* result = lval_call(e, f, v);
   lval_del(f);
   return result;
 }
+
+/* Evaluate the children of "v" and call the function at its head */
+lval* lval_eval_call(lenv* e, lval* v) {
+
+  /* Evaluate children, on this thread alone under a budget, which the */
+  /* pool's threads would not count against */
+  if (!lval_parallel || lbudget_cur || !lpar_eval_args(e, v)) {
+    for (int i = 0; i < v->count; i++) {
+      v->cell[i] = lval_eval(e, v->cell[i]);
+    }
+  }
+
+  return lval_apply(e, v);
+}
+
+/* Longest chain of list builtins fused into one loop */
+#define LPIPE_MAX 32
+
+enum { LSTAGE_MAP, LSTAGE_FILTER, LSTAGE_TAIL };
+enum { LSINK_LIST, LSINK_FOLD, LSINK_REDUCE };
+
+/* One step elements pass through on their way to the sink */
+typedef struct {
+  int kind;
+  lval* f;
+  int skip;
+} lstage;
+
+/* A fused chain such as (fold f x (map g (filter h (tail (join a b))))) */
+typedef struct {
+  lstage stages[LPIPE_MAX];
+  int nstages;
+  int sink;
+  lval* f;
+  char* op;
+  lval* acc;
+  lval* out;
+  lval* chunk[LFOLD_CHUNK];
+  int nchunk;
+} lpipe;
+
+/* Whether "s" names a builtin that can be part of a chain, checked */
+/* before looking it up so that other calls cost next to nothing */
+static int lpipe_named(const char* s) {
+  switch (s[0]) {
+    case 'm': return strcmp(s, "map") == 0;
+    case 'f': return strcmp(s, "filter") == 0 || strcmp(s, "fold") == 0;
+    case 't': return strcmp(s, "tail") == 0;
+    case 'r': return strcmp(s, "reduce") == 0;
+    case 'j': return strcmp(s, "join") == 0;
+  }
+  return 0;
+}
+
+/* The builtin "n" calls, if it is a call of an unmemoized builtin */
+static lbuiltin lpipe_head(lenv* e, lval* n) {
+  if (n->type != LVAL_SEXPR || n->count == 0) { return NULL; }
+  if (n->cell[0]->type != LVAL_SYM || !lpipe_named(n->cell[0]->sym)) { return NULL; }
+  lval* f = lenv_peek(e, n->cell[0]);
+  if (!f || f->type != LVAL_FUN || f->memo) { return NULL; }
+  return f->fun;
+}
+
+/* Calls that can pass elements along: (map f l) (filter f l) (tail l) */
+static int lpipe_is_stage(lbuiltin b, lval* n) {
+  if (b == builtin_map || b == builtin_filter) { return n->count == 3; }
+  if (b == builtin_tail) { return n->count == 2; }
+  return 0;
+}
+
+/* Calls that can end a chain: stages, (fold f x l) and (reduce f l) */
+static int lpipe_is_sink(lbuiltin b, lval* n) {
+  if (b == builtin_fold) { return n->count == 4; }
+  if (b == builtin_reduce) { return n->count == 3; }
+  return lpipe_is_stage(b, n);
+}
+
+/* Whether calling "f" on each element in turn, interleaved with the */
+/* other stages, is indistinguishable from calling it on all of them at */
+/* once: it has no effects and runs no code taken from its arguments */
+static int lpipe_pure(lval* f) {
+  lbuiltin b = f->fun;
+  return !lpar_barrier(b) && b != builtin_eval && b != builtin_future
+    && b != builtin_map && b != builtin_filter && b != builtin_fold
+    && b != builtin_reduce && b != builtin_sort_by && b != builtin_pmap
+    && b != builtin_preduce && b != builtin_pfor_range
+    && b != builtin_realize;
+}
+
+/* Find the chain of fusable calls starting at "v", outermost first, */
+/* ending in an optional (join ...) source, with the builtin each calls. */
+/* Returns its length. */
+static int lpipe_match(lenv* e, lval* v, lval** chain, lbuiltin* heads) {
+  lbuiltin b = lpipe_head(e, v);
+  if (!lpipe_is_sink(b, v)) { return 0; }
+  int depth = 0;
+  heads[depth] = b;
+  chain[depth++] = v;
+
+  lval* n = v->cell[v->count-1];
+  while (depth < LPIPE_MAX) {
+    b = lpipe_head(e, n);
+    if (b == builtin_join && n->count >= 2) {
+      heads[depth] = b;
+      chain[depth++] = n;
+      break;
+    }
+    if (!lpipe_is_stage(b, n)) { break; }
+    heads[depth] = b;
+    chain[depth++] = n;
+    n = n->cell[n->count-1];
+  }
+  return depth;
+}
+
+/* Hand the queued elements to the arithmetic builtin in one call */
+static lval* lpipe_flush(lenv* e, lpipe* p) {
+  if (p->nchunk == 0) { return NULL; }
+
+  p->acc = lval_fold_chunk(e, p->op, p->acc, p->chunk, p->nchunk);
+  p->nchunk = 0;
+  if (p->acc->type != LVAL_ERR) { return NULL; }
+  lval* err = p->acc;
+  p->acc = NULL;
+  return err;
+}
+
+/* Deliver an element that made it through every stage */
+static lval* lpipe_sink(lenv* e, lpipe* p, lval* x) {
+  if (p->sink == LSINK_LIST) {
+    p->out->cell[p->out->count++] = x;
+    return NULL;
+  }
+
+  /* Reduce starts from the first element */
+  if (!p->acc) { p->acc = x; return NULL; }
+
+  if (p->op) {
+    p->chunk[p->nchunk++] = x;
+    return (p->nchunk == LFOLD_CHUNK) ? lpipe_flush(e, p) : NULL;
+  }
+
+  p->acc = lval_call2(e, p->f, p->acc, x);
+  if (p->acc->type != LVAL_ERR) { return NULL; }
+  lval* err = p->acc;
+  p->acc = NULL;
+  return err;
+}
+
+/* Pass one element through the stages, returning an error if one fails */
+static lval* lpipe_push(lenv* e, lpipe* p, lval* x) {
+  for (int s = 0; s < p->nstages; s++) {
+    lstage* st = &p->stages[s];
+    switch (st->kind) {
+      case LSTAGE_MAP:
+        x = lval_call1(e, st->f, x);
+        if (x->type == LVAL_ERR) { return x; }
+        break;
+      case LSTAGE_FILTER: {
+        lval* t = lval_call1(e, st->f, lval_copy(x));
+        if (t->type == LVAL_ERR) { lval_del(x); return t; }
+        int keep = lval_truthy(t);
+        lval_del(t);
+        if (!keep) { lval_del(x); return NULL; }
+        break;
+      }
+      case LSTAGE_TAIL:
+        if (st->skip > 0) { st->skip--; lval_del(x); return NULL; }
+        break;
+    }
+  }
+  return lpipe_sink(e, p, x);
+}
+
+/* Add the call "n" of "b" as the next stage, merging runs of tails */
+static void lpipe_add_stage(lpipe* p, lbuiltin b, lval* n) {
+  if (b == builtin_tail) {
+    if (p->nstages > 0 && p->stages[p->nstages-1].kind == LSTAGE_TAIL) {
+      p->stages[p->nstages-1].skip++;
+      return;
+    }
+    p->stages[p->nstages++] = (lstage){ LSTAGE_TAIL, NULL, 1 };
+    return;
+  }
+  int kind = (b == builtin_map) ? LSTAGE_MAP : LSTAGE_FILTER;
+  p->stages[p->nstages++] = (lstage){ kind, n->cell[1], 0 };
+}
+
+/* Evaluate the fused chain "v" with no intermediate lists, or one call */
+/* at a time when its arguments are not what the builtins expect */
+lval* lpipe_eval(lenv* e, lval* v, lval** chain, lbuiltin* heads, int depth) {
+
+  /* Evaluate the children in place, in the order a plain call would, */
+  /* leaving each call of the chain to its parent's last child */
+  int joined = heads[depth-1] == builtin_join;
+  for (int k = 0; k < depth; k++) {
+    lval* n = chain[k];
+    int last = n->count - 1;
+    int stop = (k == depth-1) ? n->count : last;
+    for (int i = 0; i < stop; i++) { n->cell[i] = lval_eval(e, n->cell[i]); }
+    if (k + 1 < depth) {
+      n->cell[last] = lval_thaw(n->cell[last]);
+      chain[k+1] = n->cell[last];
+    }
+  }
+
+  /* Find the source lists: the joined lists or the innermost argument */
+  lval* inner = chain[depth-1];
+  lval** src = joined ? &inner->cell[1] : &inner->cell[inner->count-1];
+  int nsrc = joined ? inner->count - 1 : 1;
+
+  /* Check every function and list before any element is touched */
+  int ok = 1;
+  for (int k = 0; k < depth - joined; k++) {
+    lval* n = chain[k];
+    for (int i = 1; i < n->count - (k + 1 < depth); i++) {
+      if (n->cell[i]->type == LVAL_ERR) { ok = 0; }
+    }
+    if (n->cell[0]->type != LVAL_FUN || n->cell[0]->fun != heads[k]) { ok = 0; }
+    if (heads[k] == builtin_tail) { continue; }
+    if (n->cell[1]->type != LVAL_FUN || !lpipe_pure(n->cell[1])) { ok = 0; }
+  }
+  for (int j = 0; j < nsrc; j++) {
+    if (src[j]->type != LVAL_QEXPR && src[j]->type != LVAL_RANGE) { ok = 0; }
+  }
+
+  /* Otherwise make the calls one by one, innermost first, as usual */
+  if (!ok) {
+    for (int k = depth-1; k > 0; k--) {
+      chain[k-1]->cell[chain[k-1]->count-1] = lval_apply(e, chain[k]);
+    }
+    return lval_apply(e, v);
+  }
+
+  lpipe p;
+  p.nstages = 0;
+  p.sink = LSINK_LIST;
+  p.f = NULL;
+  p.op = NULL;
+  p.acc = NULL;
+  p.out = NULL;
+  p.nchunk = 0;
+
+  for (int k = depth - 1 - joined; k > 0; k--) { lpipe_add_stage(&p, heads[k], chain[k]); }
+
+  lbuiltin b = heads[0];
+  if (b == builtin_fold || b == builtin_reduce) {
+    p.sink = (b == builtin_fold) ? LSINK_FOLD : LSINK_REDUCE;
+    p.f = v->cell[1];
+    p.op = lfold_op(p.f);
+    if (b == builtin_fold) { p.acc = lval_pop(v, 2); }
+  } else {
+    /* Stages never add elements, so the sources bound the result */
+    lpipe_add_stage(&p, b, v);
+    long total = 0;
+    for (int j = 0; j < nsrc; j++) { total += src[j]->count; }
+    p.out = lval_qexpr();
+    p.out->cell = malloc(sizeof(lval*) * total);
+  }
+
+  /* Stream every source element through the stages */
+  lval* err = NULL;
+  for (int j = 0; j < nsrc && !err; j++) {
+    lval* q = src[j] = lval_thaw(src[j]);
+    int range = (q->type == LVAL_RANGE);
+    for (int i = 0; i < q->count && !err; i++) {
+      err = lpipe_push(e, &p, range ? lval_num(lrange_at(q, i)) : q->cell[i]);
+      if (err && !range) {
+        for (int m = i + 1; m < q->count; m++) { lval_del(q->cell[m]); }
+      }
+    }
+    q->count = 0;
+  }
+
+  if (!err) { err = (p.sink != LSINK_LIST) ? lpipe_flush(e, &p) : NULL; }
+
+  /* A tail that never got its element was handed an empty list */
+  for (int s = 0; s < p.nstages && !err; s++) {
+    if (p.stages[s].kind == LSTAGE_TAIL && p.stages[s].skip > 0) {
+      err = lval_err("Function '%s' passed {} for argument %i.", "tail", 0);
+    }
+  }
+  if (!err && p.sink == LSINK_REDUCE && !p.acc) {
+    err = lval_err("Function '%s' passed {} for argument %i.", "reduce", 1);
+  }
+
+  lval* result = (p.sink == LSINK_LIST) ? p.out : p.acc;
+  if (err) {
+    for (int i = 0; i < p.nchunk; i++) { lval_del(p.chunk[i]); }
+    if (result) { lval_del(result); }
+    result = err;
+  }
+  lval_del(v);
+  return result;
+}
+
+lval* lval_eval_sexpr(lenv* e, lval* v) {
+
+  /* Chains of list builtins run as a single loop */
+  lval* chain[LPIPE_MAX];
+  lbuiltin heads[LPIPE_MAX];
+  int depth = lpipe_match(e, v, chain, heads);
+  if (depth > 1) { return lpipe_eval(e, v, chain, heads, depth); }
+
+  return lval_eval_call(e, v);
+}
   
 lval* lval_eval(lenv* e, lval* v) {
   /* Evalyate Symbol */
@@ -709,8 +6260,14 @@ lval* lval_eval(lenv* e, lval* v) {
     lval_del(v);
     return x;
   }
-  /* Evaluate S-Expressions */
-  if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(e, v); }
+  /* Evaluate S-Expressions, which are changed in place as they go */
+  if (v->type == LVAL_SEXPR) {
+    if (lbudget_cur) {
+      lval* err = lbudget_check();
+      if (err) { lval_del(v); return err; }
+    }
+    return lval_eval_sexpr(e, lval_thaw(v));
+  }
   /* All other lval types remain the same */
   return v;
 }
@@ -719,18 +6276,26 @@ lval* lval_eval(lenv* e, lval* v) {
 /******************** READING *********************************************/
 /**************************************************************************/
 
-lval* lval_read_num(mpc_ast_t* t) {
+lval* lval_read_num(char* s) {
+
+  /* A fraction or exponent makes a float */
+  if (strpbrk(s, ".eE")) {
+    return lval_flt(strtod(s, NULL));
+  }
+
   errno = 0;
-  long x = strtol(t->contents, NULL, 10);
+  long x = strtol(s, NULL, 10);
+
+  /* Numbers outside the range of a long are read as big numbers */
   return (errno != ERANGE)
     ? lval_num(x)
-    : lval_err("Invalid number!");
+    : lval_big(lbig_read(s));
 }
 
 lval* lval_read(mpc_ast_t* t) {
 
   /* If symbol or number return conversion to that type */
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
+  if (strstr(t->tag, "number")) { return lval_read_num(t->contents); }
   if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
 
   /* If root (>), sexpr or qexpr then create an empty list */
@@ -749,15 +6314,234 @@ lval* lval_read(mpc_ast_t* t) {
     x = lval_add(x, lval_read(t->children[i]));
   }
 
+  /* Q-expression literals are immutable data and can be shared */
+  if (lval_hashcons && strstr(t->tag, "qexpr")) { return lval_intern(x); }
+
+  return x;
+}
+
+/* Whether "c" may appear in a symbol, as in the grammar */
+static int lread_sym_char(char c) {
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) { return 1; }
+  if (c >= '0' && c <= '9') { return 1; }
+  switch (c) {
+  case '_': case '+': case '-': case '*': case '/': case '\\':
+  case '=': case '<': case '>': case '%': case '^': case '!':
+  case '&': case '?': return 1;
+  }
+  return 0;
+}
+
+static int lread_digits(char* s, int i) {
+  int j = i;
+  while (s[j] >= '0' && s[j] <= '9') { j++; }
+  return j;
+}
+
+/* Whether the "n" characters of "s" are exactly a number of the grammar */
+static int lread_is_num(char* s, int n) {
+  int i = (s[0] == '-') ? 1 : 0;
+  int j = lread_digits(s, i);
+  if (j == i) { return 0; }
+  if (s[j] == '.') {
+    i = j + 1;
+    j = lread_digits(s, i);
+    if (j == i) { return 0; }
+  }
+  if (s[j] == 'e' || s[j] == 'E') {
+    i = j + 1;
+    if (s[i] == '-' || s[i] == '+') { i++; }
+    j = lread_digits(s, i);
+    if (j == i) { return 0; }
+  }
+  return j == n;
+}
+
+/* Read "input" as the parser would, without building a syntax tree, for */
+/* the common case of words separated by spaces and brackets. Returns */
+/* NULL for anything else, including all invalid input, which is left to */
+/* the parser and its messages. */
+lval* lval_read_fast(const char* input) {
+  /* Lists still open, innermost last, on the heap only if nested deeply */
+  lval* shallow[16];
+  lval** open = shallow;
+  int cap = 16, depth = 1;
+  open[0] = lval_sexpr();
+
+  const char* s = input;
+  while (*s) {
+    char c = *s;
+    if (c == ' ' || (c >= '\t' && c <= '\r')) {
+      s++;
+    } else if (c == '(' || c == '{') {
+      if (depth == cap) {
+	cap *= 2;
+	if (open == shallow) {
+	  open = malloc(sizeof(lval*) * cap);
+	  memcpy(open, shallow, sizeof(shallow));
+	} else {
+	  open = realloc(open, sizeof(lval*) * cap);
+	}
+      }
+      open[depth++] = (c == '(') ? lval_sexpr() : lval_qexpr();
+      s++;
+    } else if (c == ')' || c == '}') {
+      lval* x = open[depth - 1];
+      if (depth == 1 || x->type != (c == ')' ? LVAL_SEXPR : LVAL_QEXPR)) {
+	break;
+      }
+      if (lval_hashcons && x->type == LVAL_QEXPR) { x = lval_intern(x); }
+      depth--;
+      lval_add(open[depth - 1], x);
+      s++;
+    } else {
+      /* A word ends at a space or bracket. The parser would split words */
+      /* such as "1a" and reject "1.", so those are left to it. */
+      int n = 0;
+      while (lread_sym_char(s[n]) || s[n] == '.') { n++; }
+      if (n == 0) { break; }
+
+      char buf[64];
+      char* w = (n < 64) ? buf : malloc(n + 1);
+      memcpy(w, s, n);
+      w[n] = '\0';
+      lval* x = NULL;
+      if (lread_is_num(w, n)) {
+	x = lval_read_num(w);
+      } else if (!strchr(w, '.') && !(w[0] >= '0' && w[0] <= '9')
+		 && !(w[0] == '-' && w[1] >= '0' && w[1] <= '9')) {
+	x = lval_sym(w);
+      }
+      if (w != buf) { free(w); }
+      if (!x) { break; }
+      lval_add(open[depth - 1], x);
+      s += n;
+    }
+  }
+
+  /* Anything left over, or a list left open, goes to the parser */
+  lval* x = NULL;
+  if (*s || depth > 1) {
+    while (depth > 0) { lval_del(open[--depth]); }
+  } else {
+    x = open[0];
+  }
+  if (open != shallow) { free(open); }
   return x;
 }
 
+/* Source of top-level forms read from a file a block at a time, so */
+/* that only the form being read is ever held in memory */
+typedef struct {
+  FILE* f;
+  char* buf;
+  size_t cap, len, pos;
+  /* Line and column of "buf[pos]", counted from 0 */
+  long row, col;
+  /* Character replaced by the terminator of the last form */
+  char held;
+  int eof;
+} lreader;
+
+#define LREADER_BLOCK (1 << 16)
+
+void lreader_init(lreader* r, FILE* f) {
+  r->f = f;
+  r->cap = LREADER_BLOCK;
+  r->buf = malloc(r->cap);
+  r->buf[0] = '\0';
+  r->len = r->pos = 0;
+  r->row = r->col = 0;
+  r->held = '\0';
+  r->eof = 0;
+}
+
+/* Read another block after what is left, returning 0 at end of file. */
+/* One byte is always kept free for a terminator. */
+static int lreader_fill(lreader* r) {
+  if (r->eof) { return 0; }
+  r->len -= r->pos;
+  memmove(r->buf, r->buf + r->pos, r->len);
+  r->pos = 0;
+  if (r->cap - r->len < LREADER_BLOCK) {
+    r->cap *= 2;
+    r->buf = realloc(r->buf, r->cap);
+  }
+  size_t n = fread(r->buf + r->len, 1, r->cap - r->len - 1, r->f);
+  if (n == 0) { r->eof = 1; }
+  r->len += n;
+  return n > 0;
+}
+
+static int lreader_space(char c) {
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* The next top-level form as text, valid until the next call, or NULL */
+/* at end of file. A form is a bracketed list, which may span lines, or */
+/* a word. Where it starts is left in "row" and "col". */
+char* lreader_next(lreader* r, long* row, long* col) {
+  if (r->held) {
+    r->buf[r->pos] = r->held;
+    r->held = '\0';
+  }
+
+  /* Skip the spaces before it */
+  for (;;) {
+    if (r->pos == r->len && !lreader_fill(r)) { return NULL; }
+    char c = r->buf[r->pos];
+    if (!lreader_space(c)) { break; }
+    if (c == '\n') { r->row++; r->col = 0; } else { r->col++; }
+    r->pos++;
+  }
+  *row = r->row;
+  *col = r->col;
+
+  /* Find where it ends, reading more as needed. Brackets only need */
+  /* counting, as the grammar has no strings or comments. */
+  size_t n = 0;
+  int depth = 0;
+  for (;;) {
+    if (r->pos + n == r->len && !lreader_fill(r)) { break; }
+    char c = r->buf[r->pos + n];
+    if (depth == 0 && lreader_space(c)) { break; }
+    n++;
+    if (c == '(' || c == '{') { depth++; }
+    if ((c == ')' || c == '}') && --depth <= 0) { break; }
+  }
+
+  char* text = r->buf + r->pos;
+  for (size_t i = 0; i < n; i++) {
+    if (text[i] == '\n') { r->row++; r->col = 0; } else { r->col++; }
+  }
+  r->pos += n;
+  r->held = r->buf[r->pos];
+  r->buf[r->pos] = '\0';
+  return text;
+}
+
 /**************************************************************************/
-/******************** MAIN ************************************************/
+/******************** CONTEXT *********************************************/
 /**************************************************************************/
 
-int main(int argc, char* argv[]) {
+/* An interpreter instance with its own environment and error message. */
+/* Contexts share nothing mutable but the intern table and the worker */
+/* pool, which lock, so each may run on a thread of its own. */
+struct lctx {
+  /* Parser of the grammar, which all contexts share */
+  mpc_parser_t* Lispy;
+  lenv* env;
+  /* Message of the last input that failed to parse */
+  char* error;
+  /* Where print writes, NULL for stdout */
+  FILE* out;
+};
+
+/* Parsers of the grammar, built once, as parsing only reads them */
+static mpc_parser_t* lctx_lispy;
+static pthread_once_t lctx_grammar_once = PTHREAD_ONCE_INIT;
 
+static void lctx_grammar_init(void) {
   /* Create some Parsers */
   mpc_parser_t* Number = mpc_new("number");
   mpc_parser_t* Symbol = mpc_new("symbol");
@@ -769,7 +6553,7 @@ int main(int argc, char* argv[]) {
   /* Define them with the following language */
   mpca_lang(MPCA_LANG_DEFAULT,
 	"                                                             \
-         number   : /-?[0-9]+/ ;                                      \
+         number   : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ;      \
          symbol	  : /[a-zA-Z0-9_+\\-*\\/\\\\=<>%^!&?]+/ ;  	      \
 	 sexpr    : '(' <expr>* ')' ;                                 \
          qexpr    : '{' <expr>* '}' ;                                 \
@@ -777,44 +6561,564 @@ int main(int argc, char* argv[]) {
          lispy    : /^/ <expr>* /$/ ;				      \
         ",
 	    Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-  
-  puts("fLisp Version 0.0.0.0.6");
-  puts("Copyright ©frazeal 2017");
-  puts("Press <Ctrl> + <c> to Exit\n");
+  lctx_lispy = Lispy;
+}
+
+/* Frozen environment of the builtins, shared by every context */
+static lenv* lctx_builtins;
+static pthread_once_t lctx_builtins_once = PTHREAD_ONCE_INIT;
+
+static void lctx_builtins_init(void) {
+  lctx_builtins = lenv_new();
+  lenv_add_builtins(lctx_builtins);
+  lenv_freeze(lctx_builtins);
+}
+
+/* Build what every context shares, if not done yet, so that a process */
+/* can do it before starting others that inherit it */
+void lctx_init(void) {
+  pthread_once(&lctx_grammar_once, lctx_grammar_init);
+  pthread_once(&lctx_builtins_once, lctx_builtins_init);
+}
+
+/* A new context whose definitions go on top of the frozen environment */
+/* "base", which is the builtins alone if NULL, or one from lctx_freeze. */
+lctx* lctx_new(lenv* base) {
+  lctx_init();
+  lctx* c = malloc(sizeof(lctx));
+  c->Lispy = lctx_lispy;
+  c->env = lenv_new();
+  c->env->par = base ? base : lctx_builtins;
+  c->error = NULL;
+  c->out = NULL;
+  return c;
+}
+
+void lctx_del(lctx* c) {
+  lenv_del(c->env);
+  free(c->error);
+  free(c);
+}
+
+/* Freeze the definitions of "c" into an environment that other contexts */
+/* can start from, for as long as the program runs, and delete "c" */
+lenv* lctx_freeze(lctx* c) {
+  lenv* e = c->env;
+  lenv_freeze(e);
+  free(c->error);
+  free(c);
+  return e;
+}
+
+/* The context evaluating on the current thread, or NULL */
+lctx* lctx_self(void) {
+  return lctx_current;
+}
+
+lenv* lctx_env(lctx* c) {
+  return c->env;
+}
 
-  lenv* e = lenv_new();
-  lenv_add_builtins(e);
+/* Message of the last input that failed to parse, or NULL */
+const char* lctx_error(lctx* c) {
+  return c->error;
+}
+
+/* Send what print writes in the context to "out", or stdout if NULL */
+void lctx_set_output(lctx* c, FILE* out) {
+  c->out = out;
+}
+
+FILE* lctx_output(lctx* c) {
+  return c->out ? c->out : stdout;
+}
+
+void lctx_add_builtin(lctx* c, const char* name, lbuiltin f) {
+  lenv_add_builtin(c->env, name, f);
+}
 
-  /* read-evaluate-print loop */
-  while(1) {
+/* Parse and evaluate "input", read from "filename". Returns NULL if it */
+/* does not parse, leaving the parser's message in "c->error". */
+lval* lctx_eval(lctx* c, const char* filename, const char* input) {
+  lctx* outer = lctx_current;
+  lctx_current = c;
+
+  /* Most input is read without the parser */
+  lval* x = lval_read_fast(input);
+  mpc_result_t r;
+  if (x) {
+    x = lval_eval(c->env, x);
+  } else if (mpc_parse(filename, input, c->Lispy, &r)) {
+    x = lval_eval(c->env, lval_read(r.output));
+    mpc_ast_delete(r.output);
+  } else {
+    free(c->error);
+    c->error = mpc_err_string(r.error);
+    mpc_err_delete(r.error);
+  }
 
-    /* Output our prompt and get input */
-    char* input = readline("fLisp> ");
+  lctx_current = outer;
+  return x;
+}
 
-    /* Add input to history */
-    add_history(input);
+/* Evaluate the forms of "f" in "e" one at a time, each as soon as it has */
+/* been read, stopping at the first error. Returns the value of the last */
+/* form, or the error. */
+lval* lctx_load(lctx* c, lenv* e, const char* filename, FILE* f) {
+  lctx* outer = lctx_current;
+  lctx_current = c;
+
+  lreader r;
+  lreader_init(&r, f);
+  lval* x = lval_sexpr();
+  char* text;
+  long row, col;
+  while (x->type != LVAL_ERR && (text = lreader_next(&r, &row, &col))) {
+    lval* forms = lval_read_fast(text);
+    if (!forms) {
+      mpc_result_t res;
+      if (!mpc_parse(filename, text, c->Lispy, &res)) {
+	/* Report where the error is in the file, not in the form */
+	if (res.error->state.row == 0) { res.error->state.col += col; }
+	res.error->state.row += row;
+	char* msg = mpc_err_string(res.error);
+	mpc_err_delete(res.error);
+	msg[strcspn(msg, "\n")] = '\0';
+	lval_del(x);
+	x = lval_err("%s", msg);
+	free(msg);
+	break;
+      }
+      forms = lval_read(res.output);
+      mpc_ast_delete(res.output);
+    }
 
-    /* Attempt to parse the user input */
-    mpc_result_t r;
-    if (mpc_parse("<stdin>", input, Lispy, &r)) {
-      lval* x = lval_eval(e, lval_read(r.output));
-      lval_println(x);
+    while (forms->count > 0 && x->type != LVAL_ERR) {
       lval_del(x);
-      mpc_ast_delete(r.output);
-    } else {
-      mpc_err_print(r.error);
-      mpc_err_delete(r.error);
+      x = lval_eval(e, lval_pop(forms, 0));
     }
+    lval_del(forms);
+  }
+  free(r.buf);
+
+  lctx_current = outer;
+  return x;
+}
+
+/* Evaluate the forms in the "len" bytes at "buf" in the context */
+lval* lctx_load_buffer(lctx* c, const char* filename,
+		       const char* buf, size_t len) {
+  if (len == 0) { return lval_sexpr(); }
+  FILE* f = fmemopen((void*) buf, len, "r");
+  if (!f) { return lval_err("Could not read %s: %s.", filename, strerror(errno)); }
+  lval* x = lctx_load(c, c->env, filename, f);
+  fclose(f);
+  return x;
+}
+
+lval* builtin_load(lenv* e, lval* a) {
+  /* Check error conditions */
+  LASSERT_NUM("load", a, 1);
+  LASSERT_NAME("load", a, 0);
+  lctx* c = lctx_self();
+  LASSERT(a, c, "Function 'load' cannot be used inside a parallel task.");
+
+  char* path = lio_name(a, 0);
+  FILE* f = fopen(path, "r");
+  if (!f) { return lio_err(a, "load"); }
+  lval* x = lctx_load(c, e, path, f);
+  fclose(f);
+  lval_del(a);
+  return x;
+}
+
+/**************************************************************************/
+/******************** SERVER **********************************************/
+/**************************************************************************/
+
+/* Clients connect to a Unix socket and send one expression per line, */
+/* getting back a line with its value, or the error. Each client has a */
+/* session of its own, a context over the shared builtins, which runs as */
+/* a coroutine on one of a fixed number of worker threads, so sessions */
+/* waiting for input or I/O let the others on their thread go on. */
+/* Sessions cannot reach the files or sockets of the server, and what */
+/* they print goes to the client ahead of the reply. */
+
+typedef struct {
+  lserver* srv;
+  int fd;
+  /* Output of the session, sent with each reply */
+  char* out;
+  size_t size;
+} lsession;
+
+/* Longest request line a session accepts */
+#define LSERVE_LINE_MAX (1 << 20)
+
+/* Builtins that would give clients the files and sockets of the server, */
+/* or evaluate in the pool, whose threads run outside the session's */
+/* budget and block while they wait */
+static const char* lserve_denied[] = {
+  "open", "close", "read", "write", "pipe", "unix-listen", "unix-connect",
+  "accept", "load", "future", "await", "pmap", "preduce", "pfor-range", NULL
+};
 
-    /* Free retrieved input */
-    free(input);
-    
+/* The frozen environment sessions start from: the base of the server */
+/* with the denied builtins bound to errors */
+static lenv* lserve_sandbox(lserver* srv) {
+  lctx* c = lctx_new(srv->base);
+  for (int i = 0; lserve_denied[i]; i++) {
+    lval* k = lval_sym(lserve_denied[i]);
+    lval* v = lval_err("Function '%s' is not available to sessions.",
+		       lserve_denied[i]);
+    lenv_put(c->env, k, v);
+    lval_del(k);
+    lval_del(v);
+  }
+  return lctx_freeze(c);
+}
+
+/* Send all "len" bytes of "buf" to "fd". Returns 0 on failure. */
+static int lserve_send(int fd, char* buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+    if (n >= 0) {
+      buf += n;
+      len -= n;
+    } else if ((errno != EAGAIN && errno != EINTR)
+	       || lio_wait(fd, EPOLLOUT) < 0) {
+      return 0;
+    }
   }
+  return 1;
+}
 
-  lenv_del(e);
+/* Evaluate one line of the session within its limits and send the reply */
+static int lserve_request(lsession* s, lctx* c, lbudget* b, char* line) {
+  b->base = b->nodes;
+  b->spent = 0;
+  b->deadline = s->srv->time_limit ? lclock_ms() + s->srv->time_limit : 0;
+
+  /* The reply follows whatever was printed since the last one */
+  FILE* f = c->out;
+  if (!f) { return 0; }
+  lval* x = lctx_eval(c, "<session>", line);
+  if (x) {
+    lval_fprintln(f, x);
+    lval_del(x);
+  } else {
+    fputs(c->error, f);
+  }
+  fflush(f);
 
-  mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
-  
+  int ok = lserve_send(s->fd, s->out, s->size);
+  rewind(f);
+  return ok;
+}
+
+static void lserve_session(lco* co) {
+  lsession* s = co->data;
+
+  /* Everything the session allocates counts against its budget, which */
+  /* the coroutines it spawns share */
+  lbudget b;
+  memset(&b, 0, sizeof(b));
+  b.max_nodes = s->srv->memory_limit * 1024 * 1024 / sizeof(lval);
+  lbudget_cur = &b;
+  lctx* c = lctx_new(s->srv->env);
+  FILE* out = open_memstream(&s->out, &s->size);
+  lctx_set_output(c, out);
+
+  size_t cap = 4096, len = 0;
+  char* buf = malloc(cap);
+  for (;;) {
+    /* Answer every complete line received so far */
+    char* line = buf;
+    char* end;
+    int ok = 1;
+    while (ok && (end = memchr(line, '\n', buf + len - line))) {
+      *end = '\0';
+      if (end > line && end[-1] == '\r') { end[-1] = '\0'; }
+      ok = lserve_request(s, c, &b, line);
+      line = end + 1;
+    }
+    if (!ok) { break; }
+    len -= line - buf;
+    memmove(buf, line, len);
+
+    if (len >= LSERVE_LINE_MAX) {
+      char* err = "Error: Request is too long.\n";
+      lserve_send(s->fd, err, strlen(err));
+      break;
+    }
+    if (len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+
+    ssize_t n = read(s->fd, buf + len, cap - len);
+    if (n > 0) {
+      len += n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EINTR)
+	       || lio_wait(s->fd, EPOLLIN) < 0) {
+      break;
+    }
+  }
+  free(buf);
+  close(s->fd);
+
+  /* Stop the coroutines the session spawned, which use its context, and */
+  /* park until the last one finishes */
+  b.spent = LBUDGET_CLOSED;
+  lsched_expire(&lsched_self);
+  if (b.cos > 0) {
+    b.closer = co;
+    lsched_self.parked++;
+    swapcontext(&co->ctx, &lsched_self.main);
+  }
+  lctx_del(c);
+  if (out) { fclose(out); }
+  free(s->out);
+  free(s);
+  lbudget_cur = NULL;
+  co->result = lval_sexpr();
+}
+
+/* Take clients from the listening socket for the worker's thread */
+static void lserve_accept(lco* co) {
+  lserver* srv = co->data;
+  for (;;) {
+    int fd = accept4(srv->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED) {
+	if (lio_wait(srv->fd, EPOLLIN) < 0) { break; }
+      } else {
+	/* Out of files or memory, so give sessions a chance to end */
+	perror("accept");
+	lio_sleep(100);
+      }
+      continue;
+    }
+
+    lsession* s = malloc(sizeof(lsession));
+    s->srv = srv;
+    s->fd = fd;
+    s->out = NULL;
+    s->size = 0;
+    lco* c = lco_start(lserve_session, s);
+    if (!c) {
+      close(fd);
+      free(s);
+      continue;
+    }
+    lco_release(c);
+  }
+  perror("accept");
+  co->result = lval_sexpr();
+}
+
+static void* lserve_worker(void* arg) {
+  lco* c = lco_start(lserve_accept, arg);
+  if (c) {
+    lco_release(c);
+    while (lsched_wait()) {}
+  }
+  return NULL;
+}
+
+/* Listen on the Unix socket at "path", replacing that of an earlier */
+/* server. Returns 0 on failure, having said why. */
+static int lserve_listen(lserver* srv, const char* path) {
+  /* Clients that hang up must not take the server with them */
+  signal(SIGPIPE, SIG_IGN);
+  srv->env = lserve_sandbox(srv);
+
+  struct sockaddr_un addr;
+  srv->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (srv->fd < 0 || lio_unix_addr(path, &addr) < 0) {
+    perror(path);
+    return 0;
+  }
+  unlink(path);
+  if (bind(srv->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+      || listen(srv->fd, SOMAXCONN) < 0) {
+    perror(path);
+    return 0;
+  }
+  return 1;
+}
+
+/* Serve clients on the Unix socket at "path" with "workers" threads. */
+/* Returns only on failure. */
+int lserve_run(lserver* srv, const char* path, int workers) {
+  if (!lserve_listen(srv, path)) { return 1; }
+
+  pthread_t* threads = malloc(sizeof(pthread_t) * workers);
+  for (int i = 0; i < workers; i++) {
+    pthread_create(&threads[i], NULL, lserve_worker, srv);
+  }
+  printf("Serving on %s with %i workers\n", path, workers);
+  fflush(stdout);
+  for (int i = 0; i < workers; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  close(srv->fd);
+  return 1;
+}
+
+/* Set when the supervisor of forked workers is asked to stop */
+static volatile sig_atomic_t lserve_stopping = 0;
+
+static void lserve_stop(int sig) {
+  lserve_stopping = 1;
+}
+
+/* Fork a worker process serving on its main thread. Returns its pid. */
+static pid_t lserve_fork(lserver* srv) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    lpool_after_fork();
+    lserve_worker(srv);
+    _exit(1);
+  }
+  if (pid < 0) { perror("fork"); }
+  return pid;
+}
+
+/* Serve clients on the Unix socket at "path" with "workers" processes */
+/* forked from this one, once everything they share is built, so that */
+/* they start at once and share its pages until they change them. The */
+/* parent restarts workers that exit, until it gets SIGTERM or SIGINT. */
+int lserve_prefork(lserver* srv, const char* path, int workers) {
+  lctx_init();
+  if (!lserve_listen(srv, path)) { return 1; }
+
+  /* Stopping interrupts the wait for workers */
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = lserve_stop;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  pid_t* pids = malloc(sizeof(pid_t) * workers);
+  long* started = malloc(sizeof(long) * workers);
+  for (int i = 0; i < workers; i++) {
+    pids[i] = lserve_fork(srv);
+    started[i] = lclock_ms();
+  }
+  printf("Serving on %s with %i worker processes\n", path, workers);
+  fflush(stdout);
+
+  while (!lserve_stopping) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+      if (errno == EINTR) { continue; }
+      /* None left, as none could be forked */
+      sleep(1);
+    }
+
+    for (int i = 0; i < workers && !lserve_stopping; i++) {
+      if (pids[i] != pid && pids[i] > 0) { continue; }
+      if (pid > 0) {
+	fprintf(stderr, "Worker %i exited with status %i, restarting\n",
+		(int) pid, status);
+      }
+      /* Workers that keep failing at once are restarted slowly */
+      if (lclock_ms() - started[i] < 1000) { sleep(1); }
+      pids[i] = lserve_fork(srv);
+      started[i] = lclock_ms();
+    }
+  }
+
+  for (int i = 0; i < workers; i++) {
+    if (pids[i] > 0) { kill(pids[i], SIGTERM); }
+  }
+  while (wait(NULL) > 0 || errno == EINTR) {}
+  unlink(path);
+  close(srv->fd);
+  free(pids);
+  free(started);
   return 0;
+}
 
+/**************************************************************************/
+/******************** BATCH ***********************************************/
+/**************************************************************************/
+
+/* Pipelines send one request a line as "id<TAB>expression", and get back */
+/* "id<TAB>value" or "id<TAB>error" a line, in the same order. A line */
+/* without a tab is an expression with an empty id. Input is read and */
+/* replies are written in large blocks, with replies flushed whenever */
+/* all the input so far has been answered. */
+
+/* Size of the blocks read at first */
+#define LBATCH_BUF (1 << 16)
+
+/* Evaluate one request line and write its reply to "out" */
+static void lbatch_request(lctx* c, char* line, char* end, FILE* out) {
+  if (end > line && end[-1] == '\r') { end--; }
+  *end = '\0';
+
+  char* tab = memchr(line, '\t', end - line);
+  char* expr = line;
+  if (tab) {
+    fwrite(line, 1, tab - line, out);
+    expr = tab + 1;
+  }
+  fputc('\t', out);
+
+  lval* x = lctx_eval(c, "<batch>", expr);
+  if (x) {
+    lval_fprintln(out, x);
+    lval_del(x);
+  } else {
+    /* Keep the parser's message to the one line */
+    size_t n = strlen(c->error);
+    while (n > 0 && c->error[n - 1] == '\n') { n--; }
+    fwrite(c->error, 1, n, out);
+    fputc('\n', out);
+  }
+}
+
+/* Answer the requests read from "in" on "out" until the end of input */
+int lbatch_run(lctx* c, int in, FILE* out) {
+  setvbuf(out, NULL, _IOFBF, LBATCH_BUF);
+
+  size_t cap = LBATCH_BUF, len = 0;
+  char* buf = malloc(cap);
+  for (;;) {
+    /* Answer every complete line read so far */
+    char* line = buf;
+    char* end;
+    while ((end = memchr(line, '\n', buf + len - line))) {
+      lbatch_request(c, line, end, out);
+      line = end + 1;
+    }
+    len -= line - buf;
+    memmove(buf, line, len);
+    fflush(out);
+
+    if (len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    ssize_t n = read(in, buf + len, cap - len);
+    if (n > 0) {
+      len += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else {
+      break;
+    }
+  }
+
+  /* The last line may be missing its newline */
+  if (len > 0) { lbatch_request(c, buf, buf + len, out); }
+  fflush(out);
+  free(buf);
+  return 0;
 }